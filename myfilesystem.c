@@ -1,5 +1,6 @@
 #ifndef MYFILESYSTEM_H
 #define MYFILESYSTEM_H
+#define _FILE_OFFSET_BITS 64
 #include <sys/types.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -10,35 +11,441 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <time.h>
+
+/* version 2 directory tables start with a header record whose filename field holds DIRECTORY_MAGIC. Tables without
+the header are version 1 tables made of 72 byte records with 32 bit offsets and lengths */
+#define DIRECTORY_MAGIC "MYFSDIR2"
+#define LEGACY_RECORD_SIZE 72
+#define RECORD_SIZE 80
+
+/* the block map file of the deduplication layer starts with DEDUP_MAGIC and the number of logical blocks, followed by
+one 32 bit physical block index per logical block and then one 32 bit block_check per logical block */
+#define DEDUP_MAGIC "MYFSDEDP"
+#define DEDUP_HEADER_SIZE 16
+#define UNMAPPED_BLOCK UINT32_MAX           // logical block of zeros with no physical block, also an empty fingerprint slot
+#define TOMBSTONE_BLOCK (UINT32_MAX - 1)    // fingerprint slot whose block was removed
+#define COPY_CHUNK 16384                    // size of the buffer used to stream file contents
+
+#define READAHEAD_STREAMS 8                  // files whose sequential reads are tracked at once
+#define READAHEAD_MIN 65536                 // first read-ahead window of a sequential stream
+#define READAHEAD_MAX (4*1024*1024)         // the window doubles up to this size
+#define MERKLE_PINNED_LEVELS 16             // top levels of the merkle tree kept resident (1 MiB of hashdata)
+
+/* the redo journal <directory>.journal is a sequence of journal_record headers each followed by length bytes of
+payload for the types that carry one */
+#define JOURNAL_DATA 1                      // payload was written to the logical space at offset
+#define JOURNAL_ZERO 2                      // length bytes at offset were zeroed
+#define JOURNAL_DIRECTORY 3                 // payload was written to the directory table at offset
+#define JOURNAL_COMMIT 4                    // every record before this one is durable
+#define JOURNAL_REHASH 5                    // the image is being written without records, recovery rebuilds the merkle tree
+#define JOURNAL_GROUP_BYTES (1024*1024)     // uncommitted records that force a group commit
+#define JOURNAL_GROUP_USEC 2000             // age of the oldest uncommitted record that forces a group commit at the next call
+#define JOURNAL_CHECKPOINT_BYTES (64*1024*1024) // journal size at which the image is synced and the journal emptied
+#define JOURNAL_STAGED_BYTES (16*1024*1024) // staged pages at which the group is committed early and written back
+
+/* pages of a privately mapped file that changed since they were last written to it. While the journal is open
+filedata, hashdata, the block map and the directory table are mapped privately so a change stays in memory until the
+group journaling it is durable, then the staged pages are written to the files */
+typedef struct staged_pages {
+    int fd;                     // the file behind the mapping
+    uint8_t* bitmap;            // one bit per page of the mapping, NULL if the mapping is shared and nothing is staged
+    size_t* pages;              // the pages with their bit set, in the order they were first changed
+    size_t count;
+    size_t capacity;
+    size_t resident;            // leading pages that are not dropped from memory once written, see pin_merkle_top
+} staged_pages;
+
+/* state of the optional deduplication layer. Files are placed in a logical space of 256 byte blocks and the block map
+points each logical block at the block of filedata holding its contents, so identical blocks are stored once. Physical
+blocks are found by content through the fingerprint index, an open addressing table keyed by the leaf hash of each
+block in hashdata */
+typedef struct dedup_index {
+    char* map_data;             // mapping of the block map file
+    size_t map_size;
+    staged_pages map_pages;
+    uint32_t* block_map;        // physical block of each logical block
+    uint32_t* block_checks;     // block_check of each logical block, ties the entry to the contents it should point at
+    size_t logical_blocks;
+    uint32_t* refcount;         // number of logical blocks referring to each physical block
+    uint32_t* fingerprints;
+    size_t fingerprint_slots;   // power of two at least twice the number of physical blocks
+    size_t fingerprint_used;    // slots holding a block or a tombstone
+    size_t next_free;           // physical block the search for an unreferenced block resumes from
+    size_t free_blocks;         // physical blocks with no references
+    size_t reserved_blocks;     // free blocks held back for buffered append tails
+} dedup_index;
+
+/* write-back state of a file that is being appended to. Small appends collect in tail until they reach the end of
+a 256 byte block of filedata, so each block is written and hashed once. The space preallocated after the file is only
+held in memory, array_of_directory_blocks reports it as part of the file so other files are not placed in it while
+the directory record keeps a length that only covers written data */
+typedef struct append_buffer {
+    char filename[64];
+    uint64_t offset;            // where the file starts
+    uint64_t length;            // length of the file including the buffered tail
+    uint64_t capacity;          // length plus the preallocated space
+    uint64_t recorded;          // length in the directory record, brought up to date when the buffer is closed
+    char tail[256];             // appended bytes not yet written, all within the block holding the end of the file
+    size_t tail_length;
+    int reserved;               // 1 if a free physical block is held back so the tail can always be written
+    struct append_buffer* next;
+} append_buffer;
+
+/* sequential read detection for one file. A read starting where the previous read of the file ended doubles the
+read-ahead window and any other read resets it */
+typedef struct readahead_stream {
+    char filename[64];
+    uint64_t next_offset;       // offset in the file where a sequential read would start
+    uint64_t window;
+    uint64_t prefetched_from;   // extent of the file read-ahead was last issued for
+    uint64_t prefetched_to;
+} readahead_stream;
+
+typedef struct journal_record {
+    uint32_t type;
+    uint32_t checksum;          // FNV-1a of the header with this field zero followed by the payload
+    uint64_t sequence;
+    uint64_t offset;
+    uint64_t length;
+} journal_record;
+
+/* state of the redo journal. Every change to filedata or the directory table is appended to the journal before it is
+applied, and the records are made durable together by one fdatasync when the group is committed */
+typedef struct journal_state {
+    int fd;                     // -1 if the journal could not be opened, changes are then applied without logging
+    uint64_t sequence;          // sequence number of the next record
+    off_t size;                 // bytes written to the journal
+    off_t committed;            // end of the last commit record
+    uint64_t group_started;     // time in microseconds the oldest uncommitted record was written
+    int batch_depth;            // nesting of begin_batch calls, no group is committed inside a batch
+    int suspended;              // nesting of operations that sync the image themselves instead of logging
+} journal_state;
 
 typedef struct initial_struct {
     char* file_data;
     char* direct_table;
     char* hash_data;
+    char* filedata_map;     // filedata, hashdata and the directory table are mapped once in init_fs and used by every operation
+    char* hashdata_map;
+    char* directory_map;
+    staged_pages filedata_pages;
+    staged_pages hashdata_pages;
+    staged_pages directory_pages;
+    char* dedup_path;       // block map file of the deduplication layer, <directory>.dedup
+    dedup_index* dedup;     // NULL unless deduplication has been enabled for the image
+    char* journal_path;     // redo journal, <directory>.journal
+    journal_state journal;
+    append_buffer* appends; // files with appends buffered, closed by fsync_file, close_fs or any other write to the file
+    readahead_stream streams[READAHEAD_STREAMS];
+    int next_stream;        // stream slot reused for the next file that is not being tracked
     char filename[64];
-    unsigned int offset;
-    unsigned int length;
-    int distance;
-    int nodes_at_bottom;
+    uint64_t offset;
+    uint64_t length;
+    off_t distance;
+    size_t nodes_at_bottom;
     int height;
-    int total_nodes;
+    size_t total_nodes;
     int iterations;
-    int long size_of_directory;
-    int long size_of_filedata;
-    int long size_of_hashdata;
-    unsigned int items_copied;
-    unsigned int nulls_copied;
-    unsigned int next_space_after_repack;
-    unsigned int total_space_availible;
+    int directory_version;  // 1 for legacy 72 byte records, 2 for 80 byte records with 64 bit offset and length
+    off_t records_start;    // byte offset of the first file record (skips the version 2 header)
+    off_t record_size;
+    off_t size_of_directory;
+    off_t size_of_filedata;
+    off_t size_of_hashdata;
+    off_t logical_size;     // size of the space files are placed in, larger than filedata when deduplicating
+    size_t items_copied;
+    size_t nulls_copied;
+    uint64_t next_space_after_repack;
+    uint64_t total_space_availible;
 } initial_struct;
 
 typedef struct directory_block{
     char filename[64];
-    unsigned int offset;
-    unsigned int length;
-    unsigned int distance;
+    uint64_t offset;
+    uint64_t length;
+    off_t distance;
 } directory_block;
 
+//marks the pages holding length bytes at start of a mapping as changed, nothing is tracked for a shared mapping
+void stage_range(staged_pages* staged, uint64_t start, uint64_t length){
+    if(staged->bitmap == NULL || length == 0){
+        return;
+    }
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    for(uint64_t p = start/page; p <= (start + length - 1)/page; p++){
+        if(staged->bitmap[p/8] & (1 << (p%8))){
+            continue;
+        }
+        staged->bitmap[p/8] |= 1 << (p%8);
+        if(staged->count == staged->capacity){
+            staged->capacity = staged->capacity == 0 ? 64 : 2*staged->capacity;
+            staged->pages = realloc(staged->pages,staged->capacity*sizeof(size_t));
+        }
+        staged->pages[staged->count++] = p;
+    }
+}
+
+//marks the hashdata pages of a merkle node and of every ancestor up to the root as changed
+void stage_merkle_path(size_t index, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    while(1){
+        stage_range(&(helper_data->hashdata_pages),16*index,16);
+        if(index == 0){
+            return;
+        }
+        index = (index - 1)/2;
+    }
+}
+
+/* maps size bytes of fd for reading and writing. The mapping is private and its changes are staged when private is
+set, otherwise it is shared and changes reach the file as they are made. Returns MAP_FAILED if it cannot be mapped */
+char* map_staged(int fd, uint64_t size, int private, staged_pages* staged){
+    memset(staged,0,sizeof(staged_pages));
+    staged->fd = fd;
+    char* map = mmap(NULL, size, PROT_READ | PROT_WRITE, private ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED && private){
+        staged->bitmap = calloc(size/sysconf(_SC_PAGESIZE)/8 + 1,1);
+    }
+    return map;
+}
+
+//unmaps a mapping made by map_staged and closes its file, staged pages that were not written are lost
+void unmap_staged(char* map, uint64_t size, staged_pages* staged){
+    munmap(map,size);
+    free(staged->bitmap);
+    free(staged->pages);
+    close(staged->fd);
+}
+
+//FNV-1a over length bytes continuing from hash, used to find torn or damaged journal records
+uint32_t journal_checksum(uint32_t hash, void* data, size_t length){
+    uint8_t* bytes = (uint8_t*) data;
+    for(size_t i = 0; i < length; i++){
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//monotonic time in microseconds
+uint64_t time_usec(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (uint64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+//writes length bytes at position of the journal, returns -1 if the write could not be completed
+int journal_write(int fd, void* data, size_t length, off_t position){
+    char* bytes = (char*) data;
+    while(length > 0){
+        ssize_t written = pwrite(fd,bytes,length,position);
+        if(written <= 0){
+            return -1;
+        }
+        bytes += written;
+        position += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* writes the staged pages of a mapping of map_size bytes to its file. Each page written has its private copy dropped
+so it is read back from the page cache and takes no memory until it changes again, unless it is one of the resident
+pages at the start of the mapping. A page that cannot be written
+stays staged so the next write back retries it, and -1 is returned */
+int write_staged(staged_pages* staged, char* map, uint64_t map_size){
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    size_t failed = 0;
+    for(size_t i = 0; i < staged->count; i++){
+        uint64_t start = staged->pages[i]*page;
+        uint64_t length = map_size - start < page ? map_size - start : page;
+        if(journal_write(staged->fd,map + start,length,start) != 0){
+            staged->pages[failed++] = staged->pages[i];
+            continue;
+        }
+        staged->bitmap[staged->pages[i]/8] &= ~(1 << (staged->pages[i]%8));
+        if(staged->pages[i] >= staged->resident){
+            madvise(map + start,page,MADV_DONTNEED);
+        }
+    }
+    staged->count = failed;
+    return failed == 0 ? 0 : -1;
+}
+
+//writes every staged page of the image to its file, returns -1 if any could not be written
+int write_staged_image(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    int result = write_staged(&(helper_data->filedata_pages),helper_data->filedata_map,helper_data->size_of_filedata);
+    result |= write_staged(&(helper_data->hashdata_pages),helper_data->hashdata_map,helper_data->size_of_hashdata);
+    result |= write_staged(&(helper_data->directory_pages),helper_data->directory_map,helper_data->size_of_directory);
+    if(helper_data->dedup != NULL){
+        result |= write_staged(&(helper_data->dedup->map_pages),helper_data->dedup->map_data,helper_data->dedup->map_size);
+    }
+    return result;
+}
+
+/* writes the staged pages and forces filedata, hashdata, the block map and the directory table to disk. Once this
+returns 0 no journal record is needed to reproduce the image, -1 means a write or a sync failed */
+int journal_sync_image(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    int result = write_staged_image(helper);
+    result |= fdatasync(helper_data->filedata_pages.fd);
+    result |= fdatasync(helper_data->hashdata_pages.fd);
+    result |= fdatasync(helper_data->directory_pages.fd);
+    if(helper_data->dedup != NULL){
+        result |= fdatasync(helper_data->dedup->map_pages.fd);
+    }
+    return result == 0 ? 0 : -1;
+}
+
+/* appends a record to the journal ahead of the change it describes. The record only reaches the page cache here and
+becomes durable when its group is committed, the change itself stays staged until then. If the journal cannot be
+written journaling is switched off and the image is synced, so none of the records written so far is needed again */
+void journal_append(uint32_t type, uint64_t offset, void* payload, uint64_t length, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    if(journal->fd == -1 || (type < JOURNAL_COMMIT && (journal->suspended > 0 || length == 0))){
+        return;
+    }
+    uint64_t payload_length = (type == JOURNAL_DATA || type == JOURNAL_DIRECTORY) ? length : 0;
+    journal_record record = {type, 0, journal->sequence, offset, length};
+    record.checksum = journal_checksum(journal_checksum(2166136261u,&record,sizeof(record)),payload,payload_length);
+    if(journal_write(journal->fd,&record,sizeof(record),journal->size) != 0
+        || journal_write(journal->fd,payload,payload_length,journal->size + sizeof(record)) != 0){
+        int fd = journal->fd;
+        journal->fd = -1;
+        if(journal_sync_image(helper) == 0 && ftruncate(fd,0) == 0){
+            fdatasync(fd);
+        }
+        close(fd);
+        return;
+    }
+    if(journal->size == journal->committed){
+        journal->group_started = time_usec();
+    }
+    journal->sequence++;
+    journal->size += sizeof(record) + payload_length;
+}
+
+//ends the current group with a commit record and syncs the journal, returns -1 if the group could not be made durable
+int journal_commit_records(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    if(journal->size == journal->committed){
+        return 0;
+    }
+    journal_append(JOURNAL_COMMIT,0,NULL,0,helper);
+    if(journal->fd == -1 || fdatasync(journal->fd) != 0){
+        return -1;
+    }
+    journal->committed = journal->size;
+    return 0;
+}
+
+/* commits the current group, syncs the image and empties the journal. Called when the journal grows past
+JOURNAL_CHECKPOINT_BYTES, by close_fs and before operations that are not journaled. Nothing is written back before
+its group is committed, and the journal is only emptied once the whole image is on disk. If anything failed the
+records stay so they can still be replayed and -1 is returned. The truncation is synced as well so records that
+were checkpointed are never replayed over later changes. Without a journal staged pages are only written */
+int journal_checkpoint(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    if(journal->fd == -1){
+        return write_staged_image(helper);
+    }
+    if(journal_commit_records(helper) != 0 || journal_sync_image(helper) != 0
+        || ftruncate(journal->fd,0) != 0 || fdatasync(journal->fd) != 0){
+        return -1;
+    }
+    journal->size = 0;
+    journal->committed = 0;
+    return 0;
+}
+
+/* ends the current group with a commit record and makes the whole group durable with one fdatasync. Only then are
+the pages the group changed written to the image, so the image never holds a change the journal could lose. Returns
+-1 if the journal could not be synced, the group then stays staged, or if a page could not be written back */
+int journal_commit(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    if(journal->fd == -1){
+        return write_staged_image(helper);
+    }
+    if(journal_commit_records(helper) != 0 || write_staged_image(helper) != 0){
+        return -1;
+    }
+    if(journal->size >= JOURNAL_CHECKPOINT_BYTES){
+        return journal_checkpoint(helper);
+    }
+    return 0;
+}
+
+/* commits the current group once it holds JOURNAL_GROUP_BYTES or its oldest record is JOURNAL_GROUP_USEC old. Every
+operation, reads included, calls this as it starts, so a stream of small updates shares each fdatasync. There is no
+timer, a group left open when the file system goes idle is committed by the next call, fsync_file, end_batch or
+close_fs. Nothing is committed inside a batch */
+void journal_group_commit(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    if(journal->batch_depth > 0){
+        return;
+    }
+    if(journal->fd == -1){
+        write_staged_image(helper); // journaling was switched off, nothing has to wait for a commit
+        return;
+    }
+    if(journal->size == journal->committed){
+        return;
+    }
+    if(journal->size - journal->committed >= JOURNAL_GROUP_BYTES || time_usec() - journal->group_started >= JOURNAL_GROUP_USEC){
+        journal_commit(helper);
+    }
+}
+
+/* repack, upgrade_directory, enable_dedup and the move of a file by resize_file rewrite large parts of the image and
+are not journaled. The journal is checkpointed before them so no older record can be replayed over what they move,
+then a committed JOURNAL_REHASH record marks the image as being written without records. The image is synced and
+the journal emptied once they finish, which clears the mark. A crash in between leaves the mark and init_fs rebuilds
+the merkle tree, the data they were moving is not recovered */
+void journal_suspend(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->journal.suspended == 0){
+        journal_checkpoint(helper);
+        journal_append(JOURNAL_REHASH,0,NULL,0,helper);
+        journal_commit_records(helper);
+    }
+    helper_data->journal.suspended++;
+}
+
+void journal_resume(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    helper_data->journal.suspended--;
+    if(helper_data->journal.suspended == 0){
+        journal_checkpoint(helper);
+    }
+}
+
+/* keeps the memory held by staged pages bounded whatever the size of an operation. Once JOURNAL_STAGED_BYTES are
+staged the open group is committed early and its pages written back, inside a batch as well, so an operation that
+large is not atomic. The journal is not checkpointed here, its records are what rehashes the blocks written so far
+if the operation is cut short. While the journal is suspended the pages are written back straight away, the
+JOURNAL_REHASH mark already covers them. Called from every loop whose length depends on the size of a file or of
+the image */
+void limit_staged(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    size_t pages = helper_data->filedata_pages.count + helper_data->hashdata_pages.count + helper_data->directory_pages.count;
+    if(helper_data->dedup != NULL){
+        pages += helper_data->dedup->map_pages.count;
+    }
+    if(pages*sysconf(_SC_PAGESIZE) < JOURNAL_STAGED_BYTES){
+        return;
+    }
+    if(helper_data->journal.suspended > 0 || helper_data->journal.fd == -1 || journal_commit_records(helper) == 0){
+        write_staged_image(helper);
+    }
+}
+
 //the fletcher hash function inspired by psuedo code provided in project description
 void fletcher(uint8_t * buf, size_t length, uint8_t * output){
     uint64_t a = 0; 
@@ -47,7 +454,7 @@ void fletcher(uint8_t * buf, size_t length, uint8_t * output){
     uint64_t d = 0;
     uint32_t* data = (uint32_t*) buf;
 
-    for (int i = 0; i < length/sizeof(uint32_t);i++){
+    for (size_t i = 0; i < length/sizeof(uint32_t);i++){
         a = (a + data[i]) % (uint64_t)((pow(2,32) - 1));
         b = (b + a) % (uint64_t)((pow(2,32)-1));
         c = (c + b) % (uint64_t)((pow(2,32)-1));
@@ -105,64 +512,70 @@ void hash_block(char* current_hash,long int index,int level,char* hashdata){
 index of hashdata. All ancestral hashes are corrected using hash_block recursive function */
 void compute_hash_block(size_t block_offset, void * helper){
     initial_struct* helper_data = (initial_struct*) helper;
-    int hash = open(helper_data->hash_data,O_RDWR);
-    int file = open(helper_data->file_data,O_RDWR);
-    char* hashdata = mmap(NULL, helper_data->size_of_hashdata,PROT_READ | PROT_WRITE,MAP_SHARED,hash,0);
-    char* filedata = mmap(NULL, helper_data->size_of_filedata,PROT_READ | PROT_WRITE,MAP_SHARED,file,0);
+    char* hashdata = helper_data->hashdata_map;
     char data[256];
-    memcpy(data,filedata+(256*block_offset),256);
+    memcpy(data,helper_data->filedata_map+(256*block_offset),256);
     char new_hash[16];
     fletcher((uint8_t*)data,256,(uint8_t*)new_hash);
-    long int index_first_bottom_block = pow(2,helper_data->height) - 1; // this is the index of the first block of filedata in the binary tree hashdata i.e. the leaf on the far left
-    long int index_of_block = index_first_bottom_block + block_offset; // index of the block in the hash tree array
+    size_t index_first_bottom_block = ((size_t)1 << helper_data->height) - 1; // this is the index of the first block of filedata in the binary tree hashdata i.e. the leaf on the far left
+    size_t index_of_block = index_first_bottom_block + block_offset; // index of the block in the hash tree array
     memcpy(hashdata+(index_of_block*16),new_hash,16);
     hash_block(new_hash,index_of_block,helper_data->height, hashdata);
-    close(file);
-    close(hash);
+    stage_merkle_path(index_of_block,helper);
 }
 
-/* recusive function that computes all hashes in the tree once the leaves (bottom level) have been calculated in compute_hash_tree  */
-void hash_tree(char* hashdata, int level){
+/* recusive function that computes all hashes in the tree once the leaves (bottom level) have been calculated in compute_hash_tree.
+Each parent written is staged and the staged pages kept bounded */
+void hash_tree(char* hashdata, int level, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
     if(level == 0){
         return;
     }
     char child_hash_one[32];
     char child_hash_two[16];
     char new_hash[16];
-    int parent_index = 0;
-    for(int index = pow(2,level) -1; index <= pow(2, level+1) - 2 ; index += 2 ){ // iterates through all the nodes at each level and writes computed hash to parent node still O(n)
+    size_t parent_index = 0;
+    size_t last_index = ((size_t)1 << (level+1)) - 2;
+    for(size_t index = ((size_t)1 << level) - 1; index <= last_index; index += 2 ){ // iterates through all the nodes at each level and writes computed hash to parent node still O(n)
         memcpy(child_hash_one, hashdata + (16*index), 16 );
         memcpy(child_hash_two, hashdata + (16*(index+1)), 16 );
         memcpy(child_hash_one+16, child_hash_two, 16);       
         fletcher((uint8_t*)child_hash_one,32,(uint8_t*)new_hash);
         parent_index = (index-1)/2;
         memcpy(hashdata+(parent_index*16),new_hash,sizeof(new_hash));
+        stage_range(&(helper_data->hashdata_pages),parent_index*16,16);
+        limit_staged(helper);
     }
-    hash_tree(hashdata, level-1);
+    hash_tree(hashdata, level-1, helper);
 }
 
 /* computes hash tree. This function initially computes the hash of each leaf and writes it to hash data in the respectie index. Once
 all the leaf hashes are updated in hashdata hash_tree is called which is a recursive funtion which then computes all nodes up to the
-root hash*/
+root hash. Hashdata is rewritten without records and written back as it goes so it is never all held in memory, a
+JOURNAL_REHASH record makes recovery rebuild it if that is cut short. Nothing is moved so the journal is not
+checkpointed, records before the mark are still replayed*/
 void compute_hash_tree(void * helper){
     
     initial_struct* helper_data = (initial_struct*) helper;
-    int file = open(helper_data->file_data, O_RDWR);
-    int hash = open(helper_data->hash_data, O_RDWR);
-    char* filedata = mmap(NULL, helper_data->size_of_filedata, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
-    char* hashdata = mmap(NULL, helper_data->size_of_hashdata, PROT_READ | PROT_WRITE, MAP_SHARED, hash, 0);
+    if(helper_data->journal.suspended == 0){
+        journal_append(JOURNAL_REHASH,0,NULL,0,helper);
+    }
+    char* filedata = helper_data->filedata_map;
+    char* hashdata = helper_data->hashdata_map;
     char data[256];
-    int index_basenode = pow(2,helper_data->height) -1; // starts with value of lowest base node
+    size_t index_basenode = ((size_t)1 << helper_data->height) - 1; // starts with value of lowest base node
     uint8_t hashcode[16];
-    for(int i = 0; i < helper_data->size_of_filedata; i+=256){
+    madvise(filedata, helper_data->size_of_filedata, MADV_SEQUENTIAL); // one pass over filedata, read ahead aggressively and drop pages behind
+    for(off_t i = 0; i < helper_data->size_of_filedata; i+=256){
         memcpy( data, filedata+i, 256);
         fletcher((uint8_t*) data, 256, hashcode);       
         memcpy(hashdata+(index_basenode*16),hashcode, 16);
+        stage_range(&(helper_data->hashdata_pages),index_basenode*16,16);
+        limit_staged(helper);
         index_basenode++;
     }
-    hash_tree(hashdata, helper_data->height);
-    close(file);
-    close(hash);
+    madvise(filedata, helper_data->size_of_filedata, MADV_NORMAL);
+    hash_tree(hashdata, helper_data->height, helper);
 }
 
 /* function updates the hashdata by computing each hash block effected. compute hash block is called if
@@ -170,12 +583,18 @@ the block is effected and it is an iterative function that corrects the entire t
 computing each hash is greater than the cost to compute the entire tree then compute_hash_tree is called */
 void update_hashdata(size_t changed_bytes,size_t offset, int height, void* helper){
     initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup != NULL){
+        return; // offsets are logical and store_block has already hashed every physical block it wrote
+    }
     
     size_t distance_from_block = offset % 256; // the number of bytes from the beginning of the nearest block in filedata
     size_t first_block = (offset - distance_from_block)/256; // the index of the block in filedata
-    size_t last_block = (offset + changed_bytes)/256;
+    size_t last_block = changed_bytes > 0 ? (offset + changed_bytes - 1)/256 : first_block; // block holding the last changed byte
+    if(last_block >= helper_data->nodes_at_bottom){
+        last_block = helper_data->nodes_at_bottom - 1; // a change ending exactly at the end of filedata has no block after it
+    }
     size_t blocks_changed = last_block - first_block + 1;
-    size_t cost_compute_block = (  (log(helper_data->total_nodes + 1)) / (log(2))  )*blocks_changed ;  // the number of operations by computing each changed block
+    size_t cost_compute_block = (helper_data->height + 1)*blocks_changed ;  // the number of operations by computing each changed block
     size_t cost_compute_hashtree = helper_data->total_nodes; //cost to compute entire hashtree
 
     // printf("first index %ld\n",first_block);
@@ -183,81 +602,799 @@ void update_hashdata(size_t changed_bytes,size_t offset, int height, void* helpe
 
     if(cost_compute_block < cost_compute_hashtree){
         //compute each block
-        for(int i = first_block; i <= last_block;i++){
+        for(size_t i = first_block; i <= last_block;i++){
             compute_hash_block(i, (void*) helper_data);
         }
         return;
     } else {
         compute_hash_tree((void*) helper_data);
     }
-
-
+
+
+}
+
+/* journals and writes length bytes of the directory table at position through its mapping. The table has a fixed
+size, nothing is written past its end */
+void directory_write(off_t position, void* data, size_t length, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(position < 0 || position >= helper_data->size_of_directory){
+        return;
+    }
+    if((off_t) length > helper_data->size_of_directory - position){
+        length = helper_data->size_of_directory - position;
+    }
+    journal_append(JOURNAL_DIRECTORY,position,data,length,helper);
+    memcpy(helper_data->directory_map + position,data,length);
+    stage_range(&(helper_data->directory_pages),position,length);
+}
+
+/* reads the offset and length of the record at distance. Version 1 records store both fields as 32 bit values and
+version 2 records store them as 64 bit values */
+void read_record_fields(off_t distance, uint64_t* offset, uint64_t* length, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->directory_version == 1){
+        uint32_t fields[2] = {0};
+        memcpy(fields,helper_data->directory_map + distance + 64,sizeof(fields));
+        *offset = fields[0];
+        *length = fields[1];
+    } else {
+        memcpy(offset,helper_data->directory_map + distance + 64,sizeof(uint64_t));
+        memcpy(length,helper_data->directory_map + distance + 72,sizeof(uint64_t));
+    }
+}
+
+//writes the offset and length of the record at distance using the field width of the directory version
+void write_record_fields(off_t distance, uint64_t offset, uint64_t length, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->directory_version == 1){
+        uint32_t fields[2] = {(uint32_t) offset, (uint32_t) length};
+        directory_write(distance+64,fields,sizeof(fields),helper);
+    } else {
+        uint64_t fields[2] = {offset, length};
+        directory_write(distance+64,fields,sizeof(fields),helper);
+    }
+}
+
+//returns 1 if a file ending at end can be stored in the directory. version 1 records cannot address past 4 GiB
+int record_fits(uint64_t end, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    return helper_data->directory_version != 1 || end <= UINT32_MAX;
+}
+
+/* searches directory table for filename specified. Once filename found in directory it
+stores the filename,offset,length in the helper data.If file found return 0 for success and 
+if it cannot find the file it returns 1 for failiure */
+int block_search(char* filename,void* helper){
+    
+    initial_struct* helper_data = (initial_struct*) helper;
+    //loop through directory table checking each record
+    off_t size = helper_data->size_of_directory;
+    for(off_t i = helper_data->records_start; i + helper_data->record_size <= size; i += helper_data->record_size){
+        memcpy(helper_data->filename,helper_data->directory_map + i,64);
+        if(strcmp(helper_data->filename,filename) == 0){
+            read_record_fields(i,&(helper_data->offset),&(helper_data->length),(void*) helper_data);
+            helper_data->distance = i;
+            return 0;
+        }
+    }
+    return -1;
+
+}
+
+//compare function for qsort sorts array of files by smallest offset
+int compare(void* block, void* block_two){
+
+    directory_block* block_A = (directory_block*) block;
+    directory_block* block_B = (directory_block*) block_two;
+    return (block_A->offset > block_B->offset) - (block_A->offset < block_B->offset);
+
+}
+
+//returns the append buffer of a file or NULL if nothing is being appended to it
+append_buffer* find_append_buffer(char* filename, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    for(append_buffer* buffer = helper_data->appends; buffer != NULL; buffer = buffer->next){
+        if(strcmp(buffer->filename,filename) == 0){
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+/* Creates an array of of directory table blocks that only contain data.
+It exculdes emtpty blocks or where blocks have been deleted. This function returns a pointer
+to the array of directory table blocks. This space must be freed by the caller of function. The array is not sorted.
+A file being appended to is given the length of its append buffer's capacity so its preallocated space counts as used */
+directory_block* array_of_directory_blocks(void* helper){
+
+    initial_struct* helper_data = (initial_struct*) helper;
+    size_t max_records = (helper_data->size_of_directory - helper_data->records_start)/helper_data->record_size;
+    directory_block* array = malloc( (max_records + 1)*sizeof(directory_block) ); // malloc space needed for maximum size (i.e. worst case)
+    char null_byte[64] = {0};
+    directory_block* block = malloc(sizeof(directory_block));   
+    helper_data->items_copied = 0;
+    for(size_t i=0;i<max_records;i++){
+        off_t distance = helper_data->records_start + i*helper_data->record_size;
+        memcpy(block->filename,helper_data->directory_map + distance,64);
+        if(strcmp(block->filename,&null_byte[0]) != 0){         // compares if current filename is not null
+            read_record_fields(distance,&(block->offset),&(block->length),(void*) helper_data);
+            append_buffer* buffer = find_append_buffer(block->filename,(void*) helper_data);
+            if(buffer != NULL){
+                block->length = buffer->capacity;
+            }
+            helper_data->items_copied++;
+            block->distance = distance;
+            array[helper_data->items_copied-1] = *block;
+            
+        }        
+    }
+    free(block);
+    return array;
+
+}
+
+//returns the leaf hash of a physical block in hashdata
+char* leaf_hash(size_t physical_block, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    size_t index_first_bottom_block = ((size_t)1 << helper_data->height) - 1;
+    return helper_data->hashdata_map + 16*(index_first_bottom_block + physical_block);
+}
+
+//picks the first slot of the fingerprint index to probe for a leaf hash
+size_t fingerprint_slot(char* hash, size_t slots){
+    uint64_t key;
+    memcpy(&key,hash,sizeof(key));
+    key ^= key >> 31;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 29;
+    return key & (slots - 1);
+}
+
+//adds a physical block to the fingerprint index under its current leaf hash
+void index_block(uint32_t physical_block, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    size_t slot = fingerprint_slot(leaf_hash(physical_block,helper),dedup->fingerprint_slots);
+    while(dedup->fingerprints[slot] != UNMAPPED_BLOCK && dedup->fingerprints[slot] != TOMBSTONE_BLOCK){
+        slot = (slot + 1) & (dedup->fingerprint_slots - 1);
+    }
+    if(dedup->fingerprints[slot] == UNMAPPED_BLOCK){
+        dedup->fingerprint_used++;
+    }
+    dedup->fingerprints[slot] = physical_block;
+}
+
+/* removes a physical block from the fingerprint index. This must happen before the block or its leaf hash is
+overwritten because the slot is found through the leaf hash */
+void unindex_block(uint32_t physical_block, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    size_t slot = fingerprint_slot(leaf_hash(physical_block,helper),dedup->fingerprint_slots);
+    while(dedup->fingerprints[slot] != UNMAPPED_BLOCK){
+        if(dedup->fingerprints[slot] == physical_block){
+            dedup->fingerprints[slot] = TOMBSTONE_BLOCK;
+            return;
+        }
+        slot = (slot + 1) & (dedup->fingerprint_slots - 1);
+    }
+}
+
+/* rebuilds the fingerprint index from every referenced physical block. Called when the block map is loaded and
+when tombstones have filled too much of the table for probes to stay short */
+void rebuild_fingerprints(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    memset(dedup->fingerprints,0xff,dedup->fingerprint_slots*sizeof(uint32_t)); // every slot UNMAPPED_BLOCK
+    dedup->fingerprint_used = 0;
+    for(size_t i = 0; i < helper_data->nodes_at_bottom; i++){
+        if(dedup->refcount[i] > 0){
+            index_block(i,helper);
+        }
+    }
+}
+
+/* looks up a physical block other than exclude holding the same 256 bytes as data. Candidates are found by leaf
+hash and confirmed by a byte compare so a fletcher collision never merges different blocks */
+uint32_t find_duplicate(char* data, char* hash, uint32_t exclude, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    size_t slot = fingerprint_slot(hash,dedup->fingerprint_slots);
+    while(dedup->fingerprints[slot] != UNMAPPED_BLOCK){
+        uint32_t candidate = dedup->fingerprints[slot];
+        if(candidate != TOMBSTONE_BLOCK && candidate != exclude && memcmp(leaf_hash(candidate,helper),hash,16) == 0
+            && memcmp(helper_data->filedata_map + 256*(size_t)candidate,data,256) == 0){
+            return candidate;
+        }
+        slot = (slot + 1) & (dedup->fingerprint_slots - 1);
+    }
+    return UNMAPPED_BLOCK;
+}
+
+//drops one reference to a physical block, once nothing refers to it the block is free to be reused
+void release_block(uint32_t physical_block, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    if(physical_block == UNMAPPED_BLOCK){
+        return;
+    }
+    dedup->refcount[physical_block]--;
+    if(dedup->refcount[physical_block] == 0){
+        unindex_block(physical_block,helper);
+        dedup->free_blocks++;
+    }
+}
+
+//finds an unreferenced physical block that is not held back for an append tail, returns UNMAPPED_BLOCK if filedata is full
+uint32_t allocate_block(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    if(dedup->free_blocks <= dedup->reserved_blocks){
+        return UNMAPPED_BLOCK;
+    }
+    for(size_t n = 0; n < helper_data->nodes_at_bottom; n++){
+        size_t physical_block = (dedup->next_free + n) % helper_data->nodes_at_bottom;
+        if(dedup->refcount[physical_block] == 0){
+            dedup->next_free = physical_block + 1;
+            return physical_block;
+        }
+    }
+    return UNMAPPED_BLOCK;
+}
+
+/* returns 1 if enough physical blocks are free for a write of count bytes at start to a file ending at file_end.
+Blocks inside the file that it holds the only reference to are rewritten in place, every other block touched may need
+a new physical block */
+int dedup_has_room(uint64_t start, size_t count, uint64_t file_end, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    size_t needed = 0;
+    for(uint64_t block = start/256; block*256 < start + count; block++){
+        uint32_t physical_block = block < dedup->logical_blocks ? dedup->block_map[block] : UNMAPPED_BLOCK;
+        if(block*256 >= file_end || physical_block == UNMAPPED_BLOCK || dedup->refcount[physical_block] > 1){
+            needed++;
+        }
+    }
+    return needed + dedup->reserved_blocks <= dedup->free_blocks;
+}
+
+/* FNV-1a of a leaf hash and a logical block index. Stored for each block map entry so a read can confirm the entry
+points at the contents written to that logical block, the merkle tree only vouches for the physical block */
+uint32_t block_check(char* hash, uint64_t logical_block){
+    return journal_checksum(journal_checksum(2166136261u,hash,16),&logical_block,sizeof(uint64_t));
+}
+
+//leaf hash of the contents of a physical block, an unmapped block reads as zeros and the fletcher hash of zeros is zero
+char* mapped_hash(uint32_t physical_block, void* helper){
+    static char zero_hash[16];
+    return physical_block == UNMAPPED_BLOCK ? zero_hash : leaf_hash(physical_block,helper);
+}
+
+//stages the block map entry and the check of a logical block
+void stage_block_map(size_t logical_block, dedup_index* dedup){
+    stage_range(&(dedup->map_pages),DEDUP_HEADER_SIZE + logical_block*sizeof(uint32_t),sizeof(uint32_t));
+    stage_range(&(dedup->map_pages),DEDUP_HEADER_SIZE + (dedup->logical_blocks + logical_block)*sizeof(uint32_t),sizeof(uint32_t));
+}
+
+/* points a logical block at a physical block whose leaf hash is already up to date and stages the block map entry
+and its check */
+void set_block_map(size_t logical_block, uint32_t physical_block, void* helper){
+    dedup_index* dedup = ((initial_struct*) helper)->dedup;
+    dedup->block_map[logical_block] = physical_block;
+    dedup->block_checks[logical_block] = block_check(mapped_hash(physical_block,helper),logical_block);
+    stage_block_map(logical_block,dedup);
+}
+
+/* hands the physical block of logical block from over to logical block to and unmaps from. The check is carried
+across rather than computed again, so an entry that did not match its check still does not match after the move */
+void move_block_map(size_t to, size_t from, void* helper){
+    dedup_index* dedup = ((initial_struct*) helper)->dedup;
+    char* hash = mapped_hash(dedup->block_map[from],helper);
+    dedup->block_map[to] = dedup->block_map[from];
+    dedup->block_checks[to] = dedup->block_checks[from] ^ block_check(hash,from) ^ block_check(hash,to);
+    stage_block_map(to,dedup);
+    set_block_map(from,UNMAPPED_BLOCK,helper);
+}
+
+//copies the contents of a logical block into data, logical blocks without a physical block read as zeros
+void load_block(size_t logical_block, char* data, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(logical_block >= helper_data->dedup->logical_blocks){
+        memset(data,0,256); // nothing is mapped past the logical space
+        return;
+    }
+    uint32_t physical_block = helper_data->dedup->block_map[logical_block];
+    if(physical_block == UNMAPPED_BLOCK){
+        memset(data,0,256);
+    } else {
+        memcpy(data,helper_data->filedata_map + 256*(size_t)physical_block,256);
+    }
+}
+
+/* points a logical block at physical storage holding data. A block of zeros is left unmapped and a block already
+stored elsewhere gains a reference, so neither writes filedata or hashdata. Otherwise the bytes are written to the
+block's own physical block if it is not shared (copy on write if it is) and its path in the merkle tree is rehashed.
+Returns -1 if filedata has no free physical block left */
+int store_block(size_t logical_block, char* data, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    dedup_index* dedup = helper_data->dedup;
+    uint32_t old_block = dedup->block_map[logical_block];
+    char zero_block[256] = {0};
+    if(memcmp(data,zero_block,256) == 0){
+        release_block(old_block,helper);
+        set_block_map(logical_block,UNMAPPED_BLOCK,helper);
+        return 0;
+    }
+    char new_hash[16];
+    fletcher((uint8_t*)data,256,(uint8_t*)new_hash);
+    uint32_t duplicate = find_duplicate(data,new_hash,old_block,helper);
+    if(duplicate != UNMAPPED_BLOCK){
+        dedup->refcount[duplicate]++;
+        release_block(old_block,helper);
+        set_block_map(logical_block,duplicate,helper);
+        return 0;
+    }
+    if(old_block != UNMAPPED_BLOCK && memcmp(helper_data->filedata_map + 256*(size_t)old_block,data,256) == 0){
+        return 0; // rewriting the same contents
+    }
+
+    uint32_t target = old_block;
+    if(old_block == UNMAPPED_BLOCK || dedup->refcount[old_block] > 1){
+        target = allocate_block(helper);
+        if(target == UNMAPPED_BLOCK){
+            return -1;
+        }
+        dedup->refcount[target] = 1;
+        dedup->free_blocks--;
+        release_block(old_block,helper);
+    } else {
+        unindex_block(old_block,helper);
+    }
+    memcpy(helper_data->filedata_map + 256*(size_t)target,data,256);
+    stage_range(&(helper_data->filedata_pages),256*(size_t)target,256);
+    size_t index_of_block = ((size_t)1 << helper_data->height) - 1 + target;
+    memcpy(helper_data->hashdata_map + 16*index_of_block,new_hash,16);
+    hash_block(new_hash,index_of_block,helper_data->height,helper_data->hashdata_map);
+    stage_merkle_path(index_of_block,helper);
+    index_block(target,helper);
+    set_block_map(logical_block,target,helper);
+    if(dedup->fingerprint_used > dedup->fingerprint_slots/4*3){
+        rebuild_fingerprints(helper);
+    }
+    return 0;
+}
+
+/* copies count bytes starting at offset into buf. offset is in the logical space, without deduplication this is
+the same as filedata */
+void read_filedata(uint64_t offset, size_t count, void* buf, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup == NULL){
+        memcpy(buf,helper_data->filedata_map + offset,count);
+        return;
+    }
+    char data[256];
+    char* out = (char*) buf;
+    while(count > 0){
+        size_t distance_from_block = offset % 256;
+        size_t bytes = 256 - distance_from_block < count ? 256 - distance_from_block : count;
+        load_block(offset/256,data,helper);
+        memcpy(out,data + distance_from_block,bytes);
+        out += bytes;
+        offset += bytes;
+        count -= bytes;
+    }
+}
+
+/* writes count bytes from buf starting at offset after journaling them. Without deduplication the caller rehashes
+the range with update_hashdata, with deduplication each block is stored through store_block. Returns -1 if filedata
+is full or the range runs past the logical space */
+int write_filedata(uint64_t offset, size_t count, void* buf, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(offset + count > (uint64_t) helper_data->logical_size){
+        return -1;
+    }
+    char* in = (char*) buf;
+    if(helper_data->dedup == NULL){
+        //journaled and applied a group at most at a time so limit_staged can write back as the write goes
+        for(size_t done = 0; done < count; done += JOURNAL_GROUP_BYTES){
+            size_t bytes = count - done < JOURNAL_GROUP_BYTES ? count - done : JOURNAL_GROUP_BYTES;
+            journal_append(JOURNAL_DATA,offset + done,in + done,bytes,helper);
+            memcpy(helper_data->filedata_map + offset + done,in + done,bytes);
+            stage_range(&(helper_data->filedata_pages),offset + done,bytes);
+            limit_staged(helper);
+        }
+        return 0;
+    }
+    journal_append(JOURNAL_DATA,offset,buf,count,helper);
+    char data[256];
+    while(count > 0){
+        size_t distance_from_block = offset % 256;
+        size_t bytes = 256 - distance_from_block < count ? 256 - distance_from_block : count;
+        if(bytes < 256){
+            load_block(offset/256,data,helper); // partial block keeps the bytes around the write
+        }
+        memcpy(data + distance_from_block,in,bytes);
+        if(store_block(offset/256,data,helper) != 0){
+            return -1;
+        }
+        limit_staged(helper);
+        in += bytes;
+        offset += bytes;
+        count -= bytes;
+    }
+    return 0;
+}
+
+/* fills count bytes starting at offset with zeros, whole logical blocks lose their physical block when deduplicating.
+Returns -1 if filedata is full or the range runs past the logical space */
+int zero_filedata(uint64_t offset, size_t count, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(offset + count > (uint64_t) helper_data->logical_size){
+        return -1;
+    }
+    if(helper_data->dedup == NULL){
+        //a zero record has no payload to bound the group, so the range is split the same way as write_filedata
+        for(size_t done = 0; done < count; done += JOURNAL_GROUP_BYTES){
+            size_t bytes = count - done < JOURNAL_GROUP_BYTES ? count - done : JOURNAL_GROUP_BYTES;
+            journal_append(JOURNAL_ZERO,offset + done,NULL,bytes,helper);
+            memset(helper_data->filedata_map + offset + done,0,bytes);
+            stage_range(&(helper_data->filedata_pages),offset + done,bytes);
+            limit_staged(helper);
+        }
+        return 0;
+    }
+    journal_append(JOURNAL_ZERO,offset,NULL,count,helper);
+    char data[256];
+    while(count > 0){
+        size_t distance_from_block = offset % 256;
+        size_t bytes = 256 - distance_from_block < count ? 256 - distance_from_block : count;
+        if(bytes == 256){
+            release_block(helper_data->dedup->block_map[offset/256],helper);
+            set_block_map(offset/256,UNMAPPED_BLOCK,helper);
+        } else {
+            load_block(offset/256,data,helper); // stored directly, the zero record already covers this block
+            memset(data + distance_from_block,0,bytes);
+            if(store_block(offset/256,data,helper) != 0){
+                return -1;
+            }
+        }
+        limit_staged(helper);
+        offset += bytes;
+        count -= bytes;
+    }
+    return 0;
+}
+
+/* moves count bytes from source down to destination (destination <= source). When deduplicating and both are
+block aligned the whole blocks are moved by handing over their block map entries so no data is copied. Anything
+else is streamed forwards through a fixed size buffer which is safe for a move towards the start */
+int move_filedata(uint64_t destination, uint64_t source, size_t count, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup == NULL){
+        //moved forwards a group at a time, each piece only overlaps the part of source that has already been copied
+        for(size_t done = 0; done < count; done += JOURNAL_GROUP_BYTES){
+            size_t bytes = count - done < JOURNAL_GROUP_BYTES ? count - done : JOURNAL_GROUP_BYTES;
+            memmove(helper_data->filedata_map + destination + done,helper_data->filedata_map + source + done,bytes);
+            stage_range(&(helper_data->filedata_pages),destination + done,bytes);
+            limit_staged(helper);
+        }
+        return 0;
+    }
+    if(destination == source){
+        return 0;
+    }
+    if(destination % 256 == 0 && source % 256 == 0){
+        dedup_index* dedup = helper_data->dedup;
+        for(size_t block = 0; block < count/256; block++){
+            size_t to = destination/256 + block;
+            size_t from = source/256 + block;
+            release_block(dedup->block_map[to],helper);
+            move_block_map(to,from,helper);
+            limit_staged(helper);
+        }
+        destination += count - count % 256;
+        source += count - count % 256;
+        count = count % 256;
+    }
+    char chunk[COPY_CHUNK];
+    while(count > 0){
+        size_t bytes = count < COPY_CHUNK ? count : COPY_CHUNK;
+        read_filedata(source,bytes,chunk,helper);
+        if(write_filedata(destination,bytes,chunk,helper) != 0){
+            return -1;
+        }
+        destination += bytes;
+        source += bytes;
+        count -= bytes;
+    }
+    return 0;
+}
+
+//rounds offset up to a block boundary when deduplicating so identical files line up with identical blocks
+uint64_t align_offset(uint64_t offset, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup == NULL){
+        return offset;
+    }
+    return (offset + 255) / 256 * 256;
+}
+
+/* maps the block map file of the image if it has one, counts the references to each physical block and builds the
+fingerprint index. Returns 0 when the image is not deduplicated and -1 if the block map file is damaged */
+int load_dedup(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    int map_file = open(helper_data->dedup_path, O_RDWR);
+    if(map_file == -1){
+        return 0;
+    }
+    struct stat md;
+    fstat(map_file,&md);
+    char* map_data = MAP_FAILED;
+    staged_pages map_pages;
+    if(md.st_size >= DEDUP_HEADER_SIZE){
+        map_data = map_staged(map_file, md.st_size, helper_data->journal.fd != -1, &map_pages);
+    }
+    if(map_data == MAP_FAILED){
+        close(map_file);
+        return -1;
+    }
+    uint64_t logical_blocks;
+    memcpy(&logical_blocks,map_data + 8,sizeof(uint64_t));
+    if(memcmp(map_data,DEDUP_MAGIC,8) != 0 || (off_t)(DEDUP_HEADER_SIZE + 2*logical_blocks*sizeof(uint32_t)) > md.st_size){
+        unmap_staged(map_data,md.st_size,&map_pages);
+        return -1;
+    }
+
+    dedup_index* dedup = malloc(sizeof(dedup_index));
+    dedup->map_data = map_data;
+    dedup->map_size = md.st_size;
+    dedup->map_pages = map_pages;
+    dedup->block_map = (uint32_t*)(map_data + DEDUP_HEADER_SIZE);
+    dedup->block_checks = dedup->block_map + logical_blocks;
+    dedup->logical_blocks = logical_blocks;
+    dedup->refcount = calloc(helper_data->nodes_at_bottom,sizeof(uint32_t));
+    dedup->fingerprint_slots = 1;
+    while(dedup->fingerprint_slots < 2*helper_data->nodes_at_bottom){
+        dedup->fingerprint_slots *= 2;
+    }
+    dedup->fingerprints = malloc(dedup->fingerprint_slots*sizeof(uint32_t));
+    dedup->next_free = 0;
+    dedup->reserved_blocks = 0;
+    for(size_t i = 0; i < logical_blocks; i++){
+        if(dedup->block_map[i] == UNMAPPED_BLOCK){
+            continue;
+        }
+        if(dedup->block_map[i] >= helper_data->nodes_at_bottom){
+            unmap_staged(map_data,md.st_size,&map_pages);
+            free(dedup->refcount);
+            free(dedup->fingerprints);
+            free(dedup);
+            return -1;
+        }
+        dedup->refcount[dedup->block_map[i]]++;
+    }
+    dedup->free_blocks = 0;
+    for(size_t i = 0; i < helper_data->nodes_at_bottom; i++){
+        dedup->free_blocks += dedup->refcount[i] == 0;
+    }
+    helper_data->dedup = dedup;
+    helper_data->logical_size = logical_blocks*256;
+    rebuild_fingerprints(helper);
+    return 0;
+}
+
+/* rehashes the leaves covering length bytes at offset of the logical space. Without deduplication this goes through
+update_hashdata, with deduplication every physical block the range is mapped to is rehashed */
+void rehash_filedata(uint64_t offset, uint64_t length, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup == NULL){
+        update_hashdata(length,offset,helper_data->height,helper);
+        return;
+    }
+    dedup_index* dedup = helper_data->dedup;
+    for(uint64_t block = offset/256; block*256 < offset + length && block < dedup->logical_blocks; block++){
+        if(dedup->block_map[block] != UNMAPPED_BLOCK){
+            compute_hash_block(dedup->block_map[block],helper);
+        }
+    }
+}
+
+/* replays the journal left behind by a crash. Records up to the last commit are applied again in order and only the
+leaves they cover are rehashed. The image only ever receives committed changes, possibly torn by the crash, and
+replaying every committed record since the last checkpoint brings it back in line. Records after the last commit
+never reached the image and are dropped, as is anything after a torn or damaged record. A committed JOURNAL_REHASH
+record means the crash hit an operation that was not journaled, the whole merkle tree is then rebuilt from filedata.
+The image is then synced and the journal emptied. Returns the number of records replayed */
+int journal_recover(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_state* journal = &(helper_data->journal);
+    FILE* log = fdopen(dup(journal->fd),"rb");
+    if(log == NULL){
+        return 0;
+    }
+    char chunk[COPY_CHUNK];
+    journal_record record;
+    off_t valid_end = 0;
+    off_t last_commit = 0;
+
+    //first pass finds the end of the valid records and of the last complete group
+    while(fread(&record,sizeof(record),1,log) == 1){
+        uint64_t payload_length = (record.type == JOURNAL_DATA || record.type == JOURNAL_DIRECTORY) ? record.length : 0;
+        uint64_t limit = record.type == JOURNAL_DIRECTORY ? (uint64_t) helper_data->size_of_directory : (uint64_t) helper_data->logical_size;
+        if(record.type < JOURNAL_DATA || record.type > JOURNAL_REHASH || (valid_end > 0 && record.sequence != journal->sequence)
+            || (record.type < JOURNAL_COMMIT && (record.offset > limit || record.length > limit - record.offset))){
+            break;
+        }
+        uint32_t expected = record.checksum;
+        record.checksum = 0;
+        uint32_t checksum = journal_checksum(2166136261u,&record,sizeof(record));
+        uint64_t checked = 0;
+        while(checked < payload_length){
+            size_t bytes = payload_length - checked < COPY_CHUNK ? payload_length - checked : COPY_CHUNK;
+            if(fread(chunk,sizeof(char),bytes,log) != bytes){
+                break;
+            }
+            checksum = journal_checksum(checksum,chunk,bytes);
+            checked += bytes;
+        }
+        if(checked < payload_length || checksum != expected){
+            break;
+        }
+        journal->sequence = record.sequence + 1;
+        valid_end += sizeof(record) + payload_length;
+        if(record.type == JOURNAL_COMMIT){
+            last_commit = valid_end;
+        }
+    }
+
+    //second pass applies the committed records
+    rewind(log);
+    journal->suspended++;
+    int replayed = 0;
+    int rehash_all = 0;
+    off_t position = 0;
+    while(position < last_commit && fread(&record,sizeof(record),1,log) == 1){
+        uint64_t payload_length = (record.type == JOURNAL_DATA || record.type == JOURNAL_DIRECTORY) ? record.length : 0;
+        position += sizeof(record) + payload_length;
+        rehash_all |= record.type == JOURNAL_REHASH;
+        if(record.type >= JOURNAL_COMMIT){
+            continue;
+        }
+        if(record.type == JOURNAL_ZERO){
+            zero_filedata(record.offset,record.length,helper);
+        }
+        for(uint64_t done = 0; done < payload_length; done += COPY_CHUNK){
+            size_t bytes = payload_length - done < COPY_CHUNK ? payload_length - done : COPY_CHUNK;
+            fread(chunk,sizeof(char),bytes,log);
+            if(record.type == JOURNAL_DATA){
+                write_filedata(record.offset + done,bytes,chunk,helper);
+            } else {
+                directory_write(record.offset + done,chunk,bytes,helper);
+            }
+        }
+        if(record.type != JOURNAL_DIRECTORY){
+            rehash_filedata(record.offset,record.length,helper);
+        }
+        replayed++;
+    }
+    if(rehash_all){
+        compute_hash_tree(helper);
+    }
+    journal->suspended--;
+    fclose(log);
+    if((replayed > 0 || rehash_all) && helper_data->dedup != NULL){
+        /* replayed or rehashed blocks are keyed differently in the index. References were counted from the block map
+        on disk by load_dedup, so refcounts and free blocks already match whatever the crash left in it */
+        rebuild_fingerprints(helper);
+    }
+    if(valid_end > 0 || lseek(journal->fd,0,SEEK_END) > 0){
+        journal_checkpoint(helper);
+    }
+    return replayed;
 }
 
-
-/* searches directory table for filename specified. Once filename found in directory it
-stores the filename,offset,length in the helper data.If file found return 0 for success and 
-if it cannot find the file it returns 1 for failiure */
-int block_search(char* filename,void* helper){
-    
+//unlinks an append buffer from the list in the helper without freeing it
+void detach_append_buffer(append_buffer* buffer, void* helper){
     initial_struct* helper_data = (initial_struct*) helper;
-    FILE* directory = fopen(helper_data->direct_table,"rb");
-    if(directory == NULL){
-        printf("did not open file\n");
-    } 
-    //loop through directory table checking each 72 byte block                                
-    int long size = helper_data->size_of_directory;    
-    for(int i = 0; i < size/72; i++){
-        fseek(directory,i*72,SEEK_SET);
-        fread(helper_data->filename,sizeof(char),64,directory);
-        if(strcmp(helper_data->filename,filename) == 0){
-            fread(&(helper_data->offset),sizeof(int),1,directory);
-            fread(&(helper_data->length),sizeof(int),1,directory);
-            helper_data->distance = i*72;
-            return 0;
-        }
+    append_buffer** link = &(helper_data->appends);
+    while(*link != NULL && *link != buffer){
+        link = &((*link)->next);
+    }
+    if(*link == buffer){
+        *link = buffer->next;
     }
-    fclose(directory);
-    return -1;
-
 }
 
-//compare function for qsort sorts array of files by smallest offset
-int compare(void* block, void* block_two){
+//unlinks an append buffer, gives back the block held for its tail and frees it
+void free_append_buffer(append_buffer* buffer, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    detach_append_buffer(buffer,helper);
+    if(buffer->reserved){
+        helper_data->dedup->reserved_blocks--;
+    }
+    free(buffer);
+}
 
-    directory_block* block_A = (directory_block*) block;
-    directory_block* block_B = (directory_block*) block_two;
-    return (block_A->offset - block_B->offset);
+/* writes the buffered tail of a file to filedata and hashes the block it belongs to. Returns -1 if a deduplicated
+image has no free block for it, the tail then stays buffered */
+int flush_append_tail(append_buffer* buffer, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(buffer->tail_length == 0){
+        return 0;
+    }
+    uint64_t start = buffer->offset + buffer->length - buffer->tail_length;
+    if(buffer->reserved){
+        helper_data->dedup->reserved_blocks--; // the block held back for the tail is used for it now
+        buffer->reserved = 0;
+    }
+    if(write_filedata(start,buffer->tail_length,buffer->tail,helper) != 0){
+        return -1;
+    }
+    update_hashdata(buffer->tail_length,start,helper_data->height,helper);
+    buffer->tail_length = 0;
+    return 0;
+}
 
+/* flushes the tail of a file being appended to and records the length of the file in the directory. Returns -1 if
+the tail could not be written */
+int record_append_length(append_buffer* buffer, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(flush_append_tail(buffer,helper) != 0){
+        return -1;
+    }
+    if(buffer->recorded != buffer->length && block_search(buffer->filename,helper) == 0){
+        write_record_fields(helper_data->distance,buffer->offset,buffer->length,helper);
+        buffer->recorded = buffer->length;
+    }
+    return 0;
 }
 
-/* Creates an array of of directory table blocks that only contain data.
-It exculdes emtpty blocks or where blocks have been deleted. This function returns a pointer
-to the array of directory table blocks. This space must be freed by the caller of function. The array is not sorted */
-directory_block* array_of_directory_blocks(void* helper){
+/* records the length of a file being appended to, which gives up its preallocated space, and frees the buffer.
+Returns 0 if the file has no buffer */
+int close_append_buffer(char* filename, void* helper){
+    append_buffer* buffer = find_append_buffer(filename,helper);
+    if(buffer == NULL){
+        return 0;
+    }
+    if(record_append_length(buffer,helper) != 0){
+        return -1;
+    }
+    free_append_buffer(buffer,helper);
+    return 0;
+}
 
-    initial_struct* helper_data = (initial_struct*) helper;
-    FILE* directory = fopen(helper_data->direct_table,"r+b");
-    directory_block* array = malloc( (helper_data->size_of_directory/72)*sizeof(directory_block) ); // malloc space needed for maximum size (i.e. worst case)
-    char null_byte[64] = {0};
-    directory_block* block = malloc(sizeof(directory_block));   
-    helper_data->items_copied = 0;
-    for(int i=0;i<helper_data->size_of_directory/72;i++){
-        fseek(directory,i*72,SEEK_SET);
-        fread(block->filename,sizeof(char),64,directory);
-        if(strcmp(block->filename,&null_byte[0]) != 0){         // compares if current filename is not null
-            fread(&(block->offset),sizeof(int),1,directory);
-            fread(&(block->length),sizeof(int),1,directory);
-            helper_data->items_copied++;
-            block->distance = i*72;
-            array[helper_data->items_copied-1] = *block;
-            
-        }        
+/* asks the kernel to start reading the pages of a mapping covering length bytes from start. With populate the page
+tables are filled in as well so later accesses do not fault, this waits for any pages still being read */
+void advise_range(char* map, uint64_t map_size, uint64_t start, uint64_t length, int populate){
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t first = start / page * page;
+    uint64_t end = start + length < map_size ? start + length : map_size;
+    if(end <= first){
+        return;
     }
-    free(block);
-    fclose(directory);   
-    return array;
+#ifdef MADV_POPULATE_READ
+    if(populate && madvise(map + first, end - first, MADV_POPULATE_READ) == 0){
+        return;
+    }
+#endif
+    madvise(map + first, end - first, MADV_WILLNEED);
+}
 
+/* keeps the top levels of the merkle tree resident. Every verify and rehash walks through them so their page tables
+are populated up front, the equivalent of MAP_POPULATE for just this part of hashdata. Building with MYFS_LOCK_MERKLE
+also locks them in memory and MYFS_HUGE_PAGES asks for transparent huge pages for hashdata. Their pages are marked
+resident so writing them back does not drop them again */
+void pin_merkle_top(void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    int levels = helper_data->height + 1 < MERKLE_PINNED_LEVELS ? helper_data->height + 1 : MERKLE_PINNED_LEVELS;
+    size_t bytes = (((size_t)1 << levels) - 1)*16;
+#if defined(MYFS_HUGE_PAGES) && defined(MADV_HUGEPAGE)
+    madvise(helper_data->hashdata_map, helper_data->size_of_hashdata, MADV_HUGEPAGE);
+#endif
+#ifdef MYFS_LOCK_MERKLE
+    mlock(helper_data->hashdata_map, bytes);
+#endif
+    advise_range(helper_data->hashdata_map, helper_data->size_of_hashdata, 0, bytes, 1);
+    helper_data->hashdata_pages.resident = (bytes + sysconf(_SC_PAGESIZE) - 1)/sysconf(_SC_PAGESIZE);
 }
 
 //malloc space for myfilesystem to use throughout program
@@ -267,6 +1404,16 @@ void* init_fs(char * f1, char * f2, char * f3, int n_processors){
     helper_data->file_data = f1;        //store filenames arguments f1,f2 and f3 in helper for later use
     helper_data->direct_table = f2;
     helper_data->hash_data = f3;
+    helper_data->dedup = NULL;
+    helper_data->appends = NULL;
+    memset(helper_data->streams,0,sizeof(helper_data->streams));
+    helper_data->next_stream = 0;
+    helper_data->dedup_path = malloc(strlen(f2) + sizeof(".dedup"));
+    sprintf(helper_data->dedup_path,"%s.dedup",f2);
+    helper_data->journal_path = malloc(strlen(f2) + sizeof(".journal"));
+    sprintf(helper_data->journal_path,"%s.journal",f2);
+    memset(&(helper_data->journal),0,sizeof(journal_state));
+    helper_data->journal.fd = -1;
     FILE* directory = fopen(helper_data->direct_table,"r+b");
     FILE* file_data = fopen(helper_data->file_data,"r+b");    
     if(directory == NULL){
@@ -281,7 +1428,7 @@ void* init_fs(char * f1, char * f2, char * f3, int n_processors){
     struct stat dt;                             //find size of of both files and store them in the helper folder
     struct stat fd;
     struct stat hd;
-    int long size;
+    off_t size;
 
     if(stat(helper_data->hash_data,&hd)==0){
         size = hd.st_size;
@@ -304,123 +1451,297 @@ void* init_fs(char * f1, char * f2, char * f3, int n_processors){
         perror("could not compute file size");
     }
 
+    //a directory starting with the version 2 header uses 80 byte records, anything else is read as a legacy table
+    char magic[8] = {0};
+    fread(magic,sizeof(char),sizeof(magic),directory);
+    if(memcmp(magic,DIRECTORY_MAGIC,sizeof(magic)) == 0){
+        helper_data->directory_version = 2;
+        helper_data->records_start = RECORD_SIZE;
+        helper_data->record_size = RECORD_SIZE;
+    } else {
+        helper_data->directory_version = 1;
+        helper_data->records_start = 0;
+        helper_data->record_size = LEGACY_RECORD_SIZE;
+    }
+
     helper_data->nodes_at_bottom = helper_data->size_of_filedata/256;
-    helper_data->height = ( log(helper_data->nodes_at_bottom)/log(2) );
-    helper_data->total_nodes = pow(2,helper_data->height+1) - 1;
+    helper_data->height = 0;
+    while(((size_t)1 << (helper_data->height + 1)) <= helper_data->nodes_at_bottom){
+        helper_data->height++;
+    }
+    helper_data->total_nodes = ((size_t)1 << (helper_data->height+1)) - 1;
     
     fclose(directory);
     fclose(file_data);
+    //the journal is opened first, with it the image is mapped privately and changes are staged until they commit
+    helper_data->journal.fd = open(helper_data->journal_path, O_RDWR | O_CREAT, 0644);
+    int private = helper_data->journal.fd != -1;
+
+    //map the image once, every operation works on these mappings instead of remapping the whole file
+    helper_data->filedata_map = map_staged(open(helper_data->file_data, O_RDWR), helper_data->size_of_filedata, private, &(helper_data->filedata_pages));
+    helper_data->hashdata_map = map_staged(open(helper_data->hash_data, O_RDWR), helper_data->size_of_hashdata, private, &(helper_data->hashdata_pages));
+    helper_data->directory_map = map_staged(open(helper_data->direct_table, O_RDWR), helper_data->size_of_directory, private, &(helper_data->directory_pages));
+    int mapped = helper_data->filedata_map != MAP_FAILED && helper_data->hashdata_map != MAP_FAILED && helper_data->directory_map != MAP_FAILED;
+    if(mapped){
+        pin_merkle_top((void*) helper_data);
+        helper_data->logical_size = helper_data->size_of_filedata;
+    }
+    if(!mapped || load_dedup((void*) helper_data) != 0){
+        if(mapped){
+            printf("block map %s is damaged\n",helper_data->dedup_path);
+        } else {
+            perror("could not map filedata");
+        }
+        unmap_staged(helper_data->filedata_map, helper_data->size_of_filedata, &(helper_data->filedata_pages));
+        unmap_staged(helper_data->hashdata_map, helper_data->size_of_hashdata, &(helper_data->hashdata_pages));
+        unmap_staged(helper_data->directory_map, helper_data->size_of_directory, &(helper_data->directory_pages));
+        if(private){
+            close(helper_data->journal.fd);
+        }
+        free(helper_data->dedup_path);
+        free(helper_data->journal_path);
+        free(helper_data);
+        return NULL;
+    }
+    //changes are journaled from here on, whatever a crash left in the journal is replayed first
+    if(private){
+        journal_recover((void*) helper_data);
+    }
     return (void*) helper_data;
 
 }
 
 void close_fs(void * helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    while(helper_data->appends != NULL){
+        append_buffer* buffer = helper_data->appends;
+        if(close_append_buffer(buffer->filename,helper) != 0){
+            free_append_buffer(buffer,helper); // only a failing directory or journal gets here, drop it rather than loop
+        }
+    }
+    journal_checkpoint(helper); // the image is synced so the next init_fs has nothing to replay
+    if(helper_data->journal.fd != -1){
+        close(helper_data->journal.fd);
+    }
+    if(helper_data->dedup != NULL){
+        unmap_staged(helper_data->dedup->map_data, helper_data->dedup->map_size, &(helper_data->dedup->map_pages));
+        free(helper_data->dedup->refcount);
+        free(helper_data->dedup->fingerprints);
+        free(helper_data->dedup);
+    }
+    unmap_staged(helper_data->filedata_map, helper_data->size_of_filedata, &(helper_data->filedata_pages));
+    unmap_staged(helper_data->hashdata_map, helper_data->size_of_hashdata, &(helper_data->hashdata_pages));
+    unmap_staged(helper_data->directory_map, helper_data->size_of_directory, &(helper_data->directory_pages));
+    free(helper_data->dedup_path);
+    free(helper_data->journal_path);
     free(helper);
 }
 
+/* rewrites a version 1 directory table in the version 2 format so files can be placed past 4 GiB. The records are
+shrunk into the front of the table so this returns 2 if the existing files do not fit in the larger records */
+int upgrade_directory(void * helper){
+
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->directory_version == 2){
+        return 0;
+    }
+    directory_block* array = array_of_directory_blocks((void*) helper_data);
+    if(RECORD_SIZE + (off_t) helper_data->items_copied*RECORD_SIZE > helper_data->size_of_directory){
+        free(array);
+        return 2;
+    }
+    journal_suspend((void*) helper_data);
+    char record[RECORD_SIZE] = {0};
+    helper_data->directory_version = 2;
+    helper_data->records_start = RECORD_SIZE;
+    helper_data->record_size = RECORD_SIZE;
+
+    //header record, the offset field holds the version and the length field holds the record size
+    memcpy(record,DIRECTORY_MAGIC,sizeof(DIRECTORY_MAGIC) - 1);
+    directory_write(0,record,64,(void*) helper_data);
+    write_record_fields(0,2,RECORD_SIZE,(void*) helper_data);
+
+    for(size_t x = 0; x < helper_data->items_copied; x++){
+        off_t distance = RECORD_SIZE + x*RECORD_SIZE;
+        directory_write(distance,array[x].filename,64,(void*) helper_data);
+        append_buffer* buffer = find_append_buffer(array[x].filename,(void*) helper_data);
+        write_record_fields(distance,array[x].offset,buffer != NULL ? buffer->recorded : array[x].length,(void*) helper_data);
+    }
+
+    //clear the tail of the table that used to hold legacy records
+    memset(record,0,sizeof(record));
+    for(off_t i = RECORD_SIZE + helper_data->items_copied*RECORD_SIZE; i < helper_data->size_of_directory; i += RECORD_SIZE){
+        directory_write(i,record,RECORD_SIZE,(void*) helper_data); // the last record is cut short at the end of the table
+    }
+    journal_resume((void*) helper_data);
+    free(array);
+    return 0;
+}
+
+/* turns on deduplication for the image. Files are placed in a logical space of logical_size bytes (at least the size
+of filedata) and identical 256 byte blocks share one block of filedata, so the image can hold more data than filedata.
+The block map is kept in <directory>.dedup and is loaded by init_fs from then on. Free space and blocks already in
+filedata are deduplicated straight away. Returns 1 if logical_size is not usable */
+int enable_dedup(size_t logical_size, void * helper){
+
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->dedup != NULL){
+        return 0;
+    }
+    size_t logical_blocks = logical_size/256;
+    if(logical_size % 256 != 0 || (off_t) logical_size < helper_data->size_of_filedata
+        || logical_blocks >= TOMBSTONE_BLOCK || helper_data->nodes_at_bottom >= TOMBSTONE_BLOCK){
+        return 1;
+    }
+    for(append_buffer* buffer = helper_data->appends; buffer != NULL; buffer = buffer->next){
+        flush_append_tail(buffer,(void*) helper_data); // tails written from now on hold back a physical block
+    }
+    journal_suspend((void*) helper_data);
+    FILE* map_file = fopen(helper_data->dedup_path,"wb");
+    if(map_file == NULL){
+        journal_resume((void*) helper_data);
+        return 1;
+    }
+    //the block map starts as the identity for the blocks of filedata, the rest of the logical space is unmapped
+    uint64_t header_blocks = logical_blocks;
+    fwrite(DEDUP_MAGIC,sizeof(char),8,map_file);
+    fwrite(&header_blocks,sizeof(uint64_t),1,map_file);
+    uint32_t entries[COPY_CHUNK/sizeof(uint32_t)];
+    for(int checks = 0; checks <= 1; checks++){
+        for(size_t i = 0; i < logical_blocks; i += COPY_CHUNK/sizeof(uint32_t)){
+            size_t n = logical_blocks - i < COPY_CHUNK/sizeof(uint32_t) ? logical_blocks - i : COPY_CHUNK/sizeof(uint32_t);
+            for(size_t x = 0; x < n; x++){
+                uint32_t physical_block = i + x < helper_data->nodes_at_bottom ? i + x : UNMAPPED_BLOCK;
+                entries[x] = checks ? block_check(mapped_hash(physical_block,(void*) helper_data),i + x) : physical_block;
+            }
+            fwrite(entries,sizeof(uint32_t),n,map_file);
+        }
+    }
+    fclose(map_file);
+    if(load_dedup((void*) helper_data) != 0 || helper_data->dedup == NULL){
+        journal_resume((void*) helper_data);
+        return 1;
+    }
+
+    //free space between files is zeroed which unmaps its blocks
+    directory_block* array = array_of_directory_blocks((void*) helper_data);
+    qsort(array,helper_data->items_copied,sizeof(directory_block), (void*) compare);
+    uint64_t free_start = 0;
+    for(size_t x = 0; x < helper_data->items_copied; x++){
+        if(array[x].offset > free_start){
+            zero_filedata(free_start,array[x].offset - free_start,(void*) helper_data);
+        }
+        if(array[x].offset + array[x].length > free_start){
+            free_start = array[x].offset + array[x].length;
+        }
+    }
+    zero_filedata(free_start,logical_size - free_start,(void*) helper_data);
+    free(array);
+
+    //storing every remaining block again shares the ones that are duplicates
+    char data[256];
+    for(size_t i = 0; i < helper_data->nodes_at_bottom; i++){
+        if(helper_data->dedup->block_map[i] != UNMAPPED_BLOCK){
+            load_block(i,data,(void*) helper_data);
+            store_block(i,data,(void*) helper_data);
+            limit_staged((void*) helper_data);
+        }
+    }
+    journal_resume((void*) helper_data);
+    return 0;
+}
+
 void repack(void * helper){
 
     initial_struct* helper_data = (initial_struct*) helper;
-    int long size;
-    size = helper_data->size_of_filedata;                           //size of filedata    
-    directory_block* ptr = array_of_directory_blocks((void*) helper_data);
-    directory_block array[helper_data->items_copied];              // array of directory blocks that are not null & size of items copied
-    memcpy(array,ptr,sizeof(directory_block)*helper_data->items_copied); // copy to new array which only includes non null blocks
-    free(ptr);                                                     //free pointer returned from array_of_directory_blocks()
+    off_t size;
+    size = helper_data->logical_size;                               //size of filedata    
+    directory_block* array = array_of_directory_blocks((void*) helper_data); // array of directory blocks that are not null
     qsort(array,helper_data->items_copied,sizeof(directory_block), (void*) compare); //sort blocks by offset
-    FILE* filedata = fopen(helper_data->file_data,"r+b");
-    FILE* directory_table = fopen(helper_data->direct_table,"r+b"); 
-    int next_space_availible = 0;                                  //next_space_availible is effectively a curser of the repacked file data   
-    for(int x = 0; x < helper_data->items_copied; x++){
+    journal_suspend((void*) helper_data);
+    for(append_buffer* buffer = helper_data->appends; buffer != NULL; buffer = buffer->next){
+        flush_append_tail(buffer,(void*) helper_data); // buffered tails are tied to a block position that is about to move
+    }
+    uint64_t next_space_availible = 0;                             //next_space_availible is effectively a curser of the repacked file data
+    for(size_t x = 0; x < helper_data->items_copied; x++){
+        next_space_availible = align_offset(next_space_availible,(void*) helper_data);
+        append_buffer* buffer = find_append_buffer(array[x].filename,(void*) helper_data);
         if(next_space_availible < array[x].offset){
-            //rewrite data in file data
-            fseek(filedata,array[x].offset,SEEK_SET);
-            char data[array[x].length];
-            fread(data, sizeof(char), array[x].length, filedata);
-            fseek(filedata,next_space_availible,SEEK_SET);
-            fwrite(data,sizeof(char), array[x].length, filedata);
-            //rewrite offset in directory
-            fseek(directory_table,array[x].distance + 64, SEEK_SET);
-            fwrite(&next_space_availible,sizeof(int),1,directory_table);
+            //move data down, the move copes with the overlap so no copy of the file is held in memory
+            move_filedata(next_space_availible, array[x].offset, array[x].length,(void*) helper_data);
+            //rewrite offset in directory, a file being appended to keeps the length it has on record
+            write_record_fields(array[x].distance,next_space_availible,buffer != NULL ? buffer->recorded : array[x].length,(void*) helper_data);
+        } else {
+            next_space_availible = array[x].offset;
+        }
+        if(buffer != NULL){
+            buffer->offset = next_space_availible;
         }
         next_space_availible = next_space_availible + array[x].length;
     }
-    helper_data->next_space_after_repack = next_space_availible;
-    helper_data->total_space_availible = size - next_space_availible;
-    compute_hash_tree((void*)helper_data);
-    fclose(filedata);
-    fclose(directory_table);
+    helper_data->next_space_after_repack = align_offset(next_space_availible,(void*) helper_data);
+    helper_data->total_space_availible = size - helper_data->next_space_after_repack;
+    if(helper_data->dedup == NULL){
+        compute_hash_tree((void*)helper_data);  // deduplicated moves only touch the block map or rehash as they store
+    }
+    journal_resume((void*) helper_data);
+    free(array);
 }
 
 //creates file in next availible space
 int create_file(char * filename, size_t length, void * helper){
 
     initial_struct* helper_data = (initial_struct*) helper;
+    journal_group_commit((void*) helper_data);
     if(block_search(filename,(void*) helper_data) != -1){
         return 1;
     } 
-    FILE* directory = fopen(helper_data->direct_table,"r+b");
-    FILE* file_data = fopen(helper_data->file_data,"r+b");
-    directory_block* ptr = array_of_directory_blocks((void*) helper_data); //creates an array of files 
-    directory_block array[helper_data->items_copied];
-    memcpy(array,ptr,sizeof(directory_block)*helper_data->items_copied); 
-    free(ptr);
+    directory_block* array = array_of_directory_blocks((void*) helper_data); //creates an array of files
     qsort(array,helper_data->items_copied,sizeof(directory_block), (void*) compare); // sorts the files in order of smallest offest
     
-    char null_byte = '\0'; //written to filedata were file is created
+    char null_byte = '\0'; //written to the directory after the filename
     char *point = &null_byte;
-    int was_wrriten = 0; //boolen variable used to determine if a file was written to filedata
-    int size_of_array = helper_data->items_copied; //number of items in the array
-    int next_write_spot = 0; //index of next possible space to start writing set to 0 as the function will attempt to write at 0 if no file is presant
-    int space_to_write = 0;
-    int i; // number of iterations used to see if entire array was iterated
+    int was_wrriten = 0; //boolen variable used to determine if space for the file was found in filedata
+    size_t size_of_array = helper_data->items_copied; //number of items in the array
+    uint64_t next_write_spot = 0; //index of next possible space to start writing set to 0 as the function will attempt to write at 0 if no file is presant
+    int64_t space_to_write = 0;
+    size_t i; // number of iterations used to see if entire array was iterated
     
     // loop determines if there is enough space for new file even after filedata is repacked    
-    int space_in_disk = 0;
-    for(int y=0; y < size_of_array;y++){                          
+    uint64_t space_in_disk = 0;
+    for(size_t y=0; y < size_of_array;y++){
         space_in_disk = space_in_disk + array[y].length;
     }    
-    space_in_disk = helper_data->size_of_filedata - space_in_disk;
-    if(space_in_disk < length){
+    if(helper_data->logical_size - space_in_disk < length){
+        free(array);
         return 2;
     }    
 
     //if filedata and directory are empty
-    if(helper_data->items_copied == 0 && length < helper_data->size_of_filedata){
-        for(int x = 0; x < length; x++){
-            fwrite(point,sizeof(char),1,file_data);
-        }  
+    if(helper_data->items_copied == 0 && length < (size_t) helper_data->logical_size){
         was_wrriten = 1;
     }
 
-    //creates file in next contigious space
+    //finds the next contigious space that fits the file
     if(was_wrriten == 0){
         for(i=0;i<size_of_array;i++){
             space_to_write = array[i].offset - next_write_spot; //determines the size of the next availible contiguous spot
 
             //checks if the length of new file will fit in next space to write
-            if(space_to_write > length){
-                fseek(file_data,next_write_spot,SEEK_SET);
-                for(int x = 0; x < length; x++){
-                    fwrite(point,sizeof(char),1,file_data);
-                }                    
+            if(space_to_write > (int64_t) length){
                 was_wrriten = 1;
                 break;          
             }
             //if statement for last item in array must compare the space between end of file and next availible space
             if (i == size_of_array -1) {
-                space_to_write =  helper_data->size_of_filedata - array[i].offset - array[i].length;
-                if(space_to_write > length){
-                next_write_spot = array[i].offset + array[i].length;
-                fseek(file_data,next_write_spot,SEEK_SET);
-                for(int x = 0; x < length; x++){
-                    fwrite(point,sizeof(char),1,file_data);
-                }                    
+                next_write_spot = align_offset(array[i].offset + array[i].length,(void*) helper_data);
+                space_to_write =  helper_data->logical_size - next_write_spot;
+                if(space_to_write > (int64_t) length){
                 was_wrriten = 1;
                 break;          
                 }
             }
-            next_write_spot = array[i].offset + array[i].length;  //increase next spot availible to write to where the current file finishes
+            next_write_spot = align_offset(array[i].offset + array[i].length,(void*) helper_data);  //increase next spot availible to write to where the current file finishes
         }
     }    
 
@@ -428,108 +1749,93 @@ int create_file(char * filename, size_t length, void * helper){
     if(was_wrriten == 0 && i==size_of_array){  
         repack(helper_data);
         next_write_spot = helper_data->next_space_after_repack;
-        if(helper_data->size_of_filedata - next_write_spot > length){
-            fseek(file_data,next_write_spot,SEEK_SET);
-            for(int x = 0; x < length; x++){
-                fwrite(point,sizeof(char),1,file_data);
-            }      
+        if(helper_data->logical_size - next_write_spot > length){
             was_wrriten = 1;
         } else {
-            fclose(directory);
-            fclose(file_data);
+            free(array);
             return 2;
         }
     }   
-    int len = (int) length;
+    free(array);
+    if(was_wrriten == 1 && !record_fits(next_write_spot + length,(void*) helper_data)){
+        return 2;
+    }
 
-    //write new file into directory if written
+    //write new file into filedata and directory if space was found
     if(was_wrriten == 1){         
+        if(zero_filedata(next_write_spot,length,(void*) helper_data) != 0){
+            return 2;
+        }
         block_search(point,(void*) helper_data);    // find next space in directory table by search the first null byte to write new information  
-        fseek(directory,helper_data->distance,SEEK_SET); //seek to next availible space 
-        fwrite(filename,sizeof(char),strlen(filename),directory); 
-        fwrite(point,sizeof(char),1,directory);                 
-        fseek(directory,helper_data->distance+64,SEEK_SET);
-        fwrite(&next_write_spot,sizeof(int),1,directory);
-        fwrite(&len,sizeof(int),1,directory);
+        directory_write(helper_data->distance,filename,strlen(filename) + 1,(void*) helper_data); // filename and its null byte
+        write_record_fields(helper_data->distance,next_write_spot,length,(void*) helper_data);
         update_hashdata(length,next_write_spot,helper_data->height,(void*)helper_data); // update hash after editing file data
-        fclose(directory);
-        fclose(file_data);    
         return 0;
     }      
     
-    fclose(directory);
-    fclose(file_data); 
     return 1;
 
 }
 
 int delete_file(char * filename, void * helper){
+    journal_group_commit(helper);
+    append_buffer* buffer = find_append_buffer(filename,helper);
+    if(buffer != NULL){
+        free_append_buffer(buffer,helper); // buffered appends of a deleted file are discarded
+    }
     if(block_search(filename, helper) == -1){
         return 1;        
     }
     initial_struct* helper_data = (initial_struct*) helper;
-    FILE* directory = fopen(helper_data->direct_table,"r+b");
-    if(directory == NULL){
-        return 1;
+    char delete[RECORD_SIZE] = {0};
+    directory_write(helper_data->distance,delete,helper_data->record_size,helper);
+    if(helper_data->dedup != NULL){
+        zero_filedata(helper_data->offset,helper_data->length,helper); // hands the file's blocks back
     }
-    char num = '\0';
-    char delete[72];
-    for(int i = 0;i<64;i++){
-        delete[i] = num;
-    }
-    fseek(directory,helper_data->distance,SEEK_SET);
-    fwrite(delete,sizeof(delete),1,directory); 
-    fclose(directory);                          
     return 0;
 }
 
 int resize_file(char * filename, size_t length, void * helper){
 
     initial_struct* helper_data = (initial_struct*) helper;
+    journal_group_commit((void*) helper_data);
+    close_append_buffer(filename,(void*) helper_data);
     if(block_search(filename, (void*) helper_data) == -1){ //finds file and stores the properties of the file from the driectory table into helper data
         printf("could not find file \n");
         return 1;
     }
-    directory_block* ptr = array_of_directory_blocks((void*) helper_data); //creates an array of directory blocks that are not null
-    directory_block array[helper_data->items_copied];
-    memcpy(array,ptr,sizeof(directory_block)*helper_data->items_copied); 
-    free(ptr);
+    directory_block* array = array_of_directory_blocks((void*) helper_data); //creates an array of directory blocks that are not null
     qsort(array,helper_data->items_copied,sizeof(directory_block), (void*) compare); //sorts the array by smallest offset
-    int sizeOfarray = helper_data->items_copied;
-    FILE* directory = fopen(helper_data->direct_table,"r+b");
-    FILE* file_data = fopen(helper_data->file_data,"r+b");
-    char* data = (char*) calloc(length,sizeof(char));
-    int oldlength = helper_data->length;
-    char original_data[helper_data->length];
-    int i;
-    int space_in_disk = 0;
+    size_t sizeOfarray = helper_data->items_copied;
+    uint64_t oldlength = helper_data->length;
+    size_t i = 0;
+    uint64_t space_in_disk = 0;
 
     // loop determines if there is enough space for rezize after filedata has been repacked    
-    for(int y=0; y < sizeOfarray;y++){                          
+    for(size_t y=0; y < sizeOfarray;y++){
         if(strcmp((array[y].filename),filename) == 0){
             i = y;             
         }
         space_in_disk = space_in_disk + array[y].length;
     }    
     space_in_disk = space_in_disk - array[i].length;
-    space_in_disk = helper_data->size_of_filedata - space_in_disk;
+    space_in_disk = helper_data->logical_size - space_in_disk;
     if(space_in_disk < length){
-        free(data);
+        free(array);
         return 2;
     }
-
     /* if" determines if the resize is smaller(and file must be concatenated) or 
     greater than current length(and file size should be increased if there is space) */
     if(oldlength > length ){
         //resizing to smaller length
-        fseek(file_data,helper_data->offset + length,SEEK_SET);
-        fwrite(data,sizeof(char),1,file_data);
-        fseek(directory,helper_data->distance+68,SEEK_SET);
-        fwrite(&length,sizeof(int),1,directory);
-        fclose(directory);
-        fclose(file_data);
+        if(helper_data->dedup != NULL){
+            zero_filedata(helper_data->offset + length,oldlength - length,(void*) helper_data);
+        } else {
+            zero_filedata(helper_data->offset + length,1,(void*) helper_data);
+        }
+        write_record_fields(helper_data->distance,helper_data->offset,length,(void*) helper_data);
         update_hashdata(0,helper_data->offset + length,helper_data->height,(void*) helper_data);
-        free(data);
+        free(array);
         return 0;
     } else if(oldlength < length ){
         // resizing to a greater length need to check if repack is needed before increase size
@@ -537,79 +1843,98 @@ int resize_file(char * filename, size_t length, void * helper){
         /* determines the index of the next item. the next_item == the start of the next folder or 
         if it's the last file in filedata the next_item is the end of the file size. next item is used to determine
         if there is space at the current position to resize before it hits the next item/file */
-        int next_item;
+        uint64_t next_item;
         if(i < sizeOfarray-1){
             next_item = array[i+1].offset; 
-        } else if(i == sizeOfarray-1){
-            next_item = helper_data->size_of_filedata;
+        } else {
+            next_item = helper_data->logical_size;
         }  
 
         //If resize cannot hapen in the next contiguous space repack and write file at the end
         if(helper_data->offset + length > next_item){
+            if(!record_fits(helper_data->logical_size - space_in_disk + length,(void*) helper_data)){
+                free(array);
+                return 2;
+            }
             
-            //store original data            
-            fseek(file_data,array[i].offset,SEEK_SET);
-            fread(original_data,sizeof(char),array[i].length,file_data);
+            /* store original data. It is streamed through a temporary file rather than held in memory because
+            the repack may overwrite its current position */
+            FILE* original_data = tmpfile();
+            if(original_data == NULL){
+                free(array);
+                return 1;
+            }
+            char chunk[COPY_CHUNK];
+            for(uint64_t copied = 0; copied < array[i].length; copied += COPY_CHUNK){
+                size_t bytes = array[i].length - copied < COPY_CHUNK ? array[i].length - copied : COPY_CHUNK;
+                read_filedata(array[i].offset + copied,bytes,chunk,(void*) helper_data);
+                fwrite(chunk,sizeof(char),bytes,original_data);
+            }
 
-            // repack and change directory
+            /* repack and change directory. The file is deleted and added back behind the other files in one
+            unjournaled step, a checkpoint between the two would make the delete durable on its own */
+            journal_suspend((void*) helper_data);
             delete_file(filename, (void*) helper_data);
             repack((void*) helper_data);
-            fseek(directory,array[i].distance,SEEK_SET);
-            fwrite(array[i].filename,sizeof(char),sizeof(array[i].filename),directory);
-            fwrite(data,sizeof(char),1,directory);
-            fseek(directory,array[i].distance+64,SEEK_SET);
-            fwrite(&(helper_data->next_space_after_repack),sizeof(int),1,directory);
-            fwrite(&(length),sizeof(int),1,directory);
+
+            //deduplicated repacks pad each file to a block boundary so the new length may still not fit, the file then goes back unchanged
+            uint64_t new_length = length;
+            if(helper_data->next_space_after_repack + length > (uint64_t) helper_data->logical_size){
+                new_length = array[i].length;
+            }
+            directory_write(array[i].distance,array[i].filename,sizeof(array[i].filename),(void*) helper_data);
+            write_record_fields(array[i].distance,helper_data->next_space_after_repack,new_length,(void*) helper_data);
 
             //write to filedata
-            fseek(file_data,helper_data->next_space_after_repack,SEEK_SET);
-            fwrite(original_data,sizeof(char),array[i].length,file_data);
-            fwrite(data,sizeof(char),length-array[i].length,file_data);
-            fclose(directory);
-            fclose(file_data);
-            update_hashdata(length,helper_data->next_space_after_repack,helper_data->height,(void*) helper_data); // update hashdata after repack
-            free(data);
-            return 0;
+            rewind(original_data);
+            int stored = 0;
+            for(uint64_t copied = 0; copied < array[i].length; copied += COPY_CHUNK){
+                size_t bytes = array[i].length - copied < COPY_CHUNK ? array[i].length - copied : COPY_CHUNK;
+                fread(chunk,sizeof(char),bytes,original_data);
+                stored |= write_filedata(helper_data->next_space_after_repack + copied,bytes,chunk,(void*) helper_data);
+            }
+            fclose(original_data);
+            stored |= zero_filedata(helper_data->next_space_after_repack + array[i].length,new_length-array[i].length,(void*) helper_data);
+            update_hashdata(new_length,helper_data->next_space_after_repack,helper_data->height,(void*) helper_data); // update hashdata after repack
+            journal_resume((void*) helper_data);
+            free(array);
+            return stored == 0 && new_length == length ? 0 : 2;
 
         } else {   
+            if(!record_fits(helper_data->offset + length,(void*) helper_data)){
+                free(array);
+                return 2;
+            }
             //write null bytes into new spaces after already existing file data         
-            fseek(file_data, helper_data->offset+helper_data->length, SEEK_SET);
-            fwrite(data, sizeof(char), length-helper_data->length, file_data);
-            fseek(directory,helper_data->distance+68,SEEK_SET);
-            fwrite(&length,sizeof(int),1,directory);
-            fclose(directory);
-            fclose(file_data);
+            if(zero_filedata(helper_data->offset + helper_data->length,length-helper_data->length,(void*) helper_data) != 0){
+                free(array);
+                return 2;
+            }
+            write_record_fields(helper_data->distance,helper_data->offset,length,(void*) helper_data);
             update_hashdata(length-helper_data->length,helper_data->offset+helper_data->length,helper_data->height,(void*) helper_data);
-            free(data);
+            free(array);
             return 0;
         }        
     }     
-    free(data);
+    free(array);
     return 1;
 
 }
 
 int rename_file(char * oldname, char * newname, void * helper){
+    journal_group_commit(helper);
     if(strlen(newname)>64){
         return 1;
     }
     if(block_search(newname, helper) == 0){
         return 1;        
     }
+    close_append_buffer(oldname, helper);
     if(block_search(oldname, helper) == -1){
         return 1;        
     }
     initial_struct* helper_data = (initial_struct*) helper;
-    FILE* directory = fopen(helper_data->direct_table,"r+b");
-    if(directory == NULL){
-        printf("did not open file\n");
-        return 1;
-    }
-    char delete = '\0';
-    fseek(directory,helper_data->distance,SEEK_SET);
-    fwrite(newname,strlen(newname),1,directory);
-    fwrite(&delete,sizeof(char),1,directory); 
-    fclose(directory);                          
+    directory_write(helper_data->distance,newname,strlen(newname) + 1,helper); // new name and its null byte                          
     return 0;                 
     
 }
@@ -660,29 +1985,40 @@ int verify_hash(char* current_hash,long int index,int level,char* hashdata){
 int verify_hashes_read(size_t offset,size_t count, void* helper){
 
     initial_struct* helper_data = (initial_struct*) helper;
-    size_t bottom_left_leaf_index = pow(2, helper_data->height) -1;
+    size_t bottom_left_leaf_index = ((size_t)1 << helper_data->height) - 1;
     size_t distance_from_block = (helper_data->offset+offset) % 256; // the number of bytes from the beginning of the nearest block in filedata
     size_t block_index = ((helper_data->offset+offset) - distance_from_block)/256; // the index of the block in filedata
-    size_t index_in_hashtree = bottom_left_leaf_index + block_index; // the index of the first block where reading starts in the binary tree
     distance_from_block = (helper_data->offset+offset+count) % 256; // the number of bytes from the nearest block for last block read
     size_t last_block_index = ((helper_data->offset+offset+count) - distance_from_block)/256; // the index of last block read in filedata
-    size_t last_index_read = bottom_left_leaf_index + last_block_index; // index in binary tree of last block read
+    if(last_block_index >= (size_t) helper_data->logical_size/256){
+        last_block_index = helper_data->logical_size/256 - 1;
+    }
     
     char filedata_hash[16];
     char current_hashdata[16];
     char data[256];
-    int file = open(helper_data->file_data, O_RDWR);
-    int hash = open(helper_data->hash_data, O_RDWR);
-    char* filedata = mmap(NULL, helper_data->size_of_filedata, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
-    char* hashdata = mmap(NULL, helper_data->size_of_hashdata, PROT_READ | PROT_WRITE, MAP_SHARED, hash, 0);
+    char* filedata = helper_data->filedata_map;
+    char* hashdata = helper_data->hashdata_map;
     int verified = -1;
     
     /* compute hash for the block read and compare it with current hash in hashdata. Then recursively move up through the binary tree
     comparing the hashdata to the hash calculated from the block read. the loop iterates through every block that has been read*/
-    for(size_t i=index_in_hashtree;i<=last_index_read;i++){
-        memcpy(data,filedata+(256*block_index),256);
-        block_index++;
-        fletcher((uint8_t*)data,256,(uint8_t*)filedata_hash); //the filedata from the block read into fletcher
+    for(;block_index<=last_block_index;block_index++){
+        size_t physical_block = helper_data->dedup != NULL ? helper_data->dedup->block_map[block_index] : block_index;
+        char* read_hash = mapped_hash(UNMAPPED_BLOCK,helper); // an unmapped block reads as zeros
+        if(physical_block != UNMAPPED_BLOCK){
+            memcpy(data,filedata+(256*physical_block),256);
+            fletcher((uint8_t*)data,256,(uint8_t*)filedata_hash); //the filedata from the block read into fletcher
+            read_hash = filedata_hash;
+        }
+        //the block map entry must point at the contents written to this logical block
+        if(helper_data->dedup != NULL && helper_data->dedup->block_checks[block_index] != block_check(read_hash,block_index)){
+            return 1;
+        }
+        if(physical_block == UNMAPPED_BLOCK){
+            continue; // nothing stored to verify against the merkle tree
+        }
+        size_t i = bottom_left_leaf_index + physical_block; // index of the block in the binary tree
         memcpy(current_hashdata,hashdata+(i*16),16);
         if(memcmp(current_hashdata,filedata_hash,16) != 0){  //checks if first hash calculated above is same as value in hashdata
             return 1;
@@ -697,19 +2033,104 @@ int verify_hashes_read(size_t offset,size_t count, void* helper){
     return 0;
 }
 
+/* prefetches the hashdata a verify of physical blocks first_block to last_block will walk: the leaves and, level by
+level, their ancestors and the siblings hashed with them, down to the levels kept resident by pin_merkle_top */
+void advise_merkle(size_t first_block, size_t last_block, int populate, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    for(int level = helper_data->height; level >= MERKLE_PINNED_LEVELS; level--){
+        int shift = helper_data->height - level;
+        size_t first_index = ((size_t)1 << level) - 1 + ((first_block >> shift) & ~(size_t)1);
+        size_t last_index = ((size_t)1 << level) - 1 + ((last_block >> shift) | 1);
+        advise_range(helper_data->hashdata_map, helper_data->size_of_hashdata, 16*first_index, 16*(last_index - first_index + 1), populate);
+    }
+}
+
+/* prefetches count bytes of the logical space from offset together with the hashdata needed to verify them. With
+deduplication the blocks are scattered through filedata so each run of consecutive physical blocks is advised */
+void prefetch_filedata(uint64_t offset, size_t count, int populate, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    size_t first_block = offset/256;
+    size_t last_block = (offset + count - 1)/256;
+    if(helper_data->dedup == NULL){
+        advise_range(helper_data->filedata_map, helper_data->size_of_filedata, offset, count, populate);
+        advise_merkle(first_block, last_block, populate, helper);
+        return;
+    }
+    size_t run_start = UNMAPPED_BLOCK;
+    size_t run_end = UNMAPPED_BLOCK;
+    for(size_t block = first_block; block <= last_block + 1; block++){
+        size_t physical_block = block <= last_block ? helper_data->dedup->block_map[block] : UNMAPPED_BLOCK;
+        if(physical_block != UNMAPPED_BLOCK && physical_block == run_end + 1){
+            run_end = physical_block;
+            continue;
+        }
+        if(run_start != UNMAPPED_BLOCK){
+            advise_range(helper_data->filedata_map, helper_data->size_of_filedata, 256*run_start, 256*(run_end - run_start + 1), populate);
+            advise_merkle(run_start, run_end, populate, helper);
+        }
+        run_start = physical_block;
+        run_end = physical_block;
+    }
+}
+
+/* tracks reads of a file and issues read-ahead for sequential ones. While reads carry on from where the last one
+ended the window doubles from READAHEAD_MIN to READAHEAD_MAX, and once half a window has been consumed the next
+extent of the file is prefetched. The extent prefetched the time before has had time to arrive by then, so its page
+tables are populated and the reads through it do not fault. A read anywhere else resets the stream */
+void advise_readahead(char* filename, size_t offset, size_t count, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    readahead_stream* stream = NULL;
+    for(int i = 0; i < READAHEAD_STREAMS; i++){
+        if(strcmp(helper_data->streams[i].filename,filename) == 0){
+            stream = &(helper_data->streams[i]);
+            break;
+        }
+    }
+    if(stream == NULL){
+        stream = &(helper_data->streams[helper_data->next_stream]);
+        helper_data->next_stream = (helper_data->next_stream + 1) % READAHEAD_STREAMS;
+        strncpy(stream->filename,filename,sizeof(stream->filename) - 1);
+        stream->next_offset = UINT64_MAX;
+    }
+    uint64_t read_end = offset + count;
+    if(offset != stream->next_offset){
+        stream->window = 0;
+        stream->prefetched_from = read_end;
+        stream->prefetched_to = read_end;
+    } else {
+        stream->window = stream->window == 0 ? READAHEAD_MIN : stream->window*2;
+        if(stream->window > READAHEAD_MAX){
+            stream->window = READAHEAD_MAX;
+        }
+        uint64_t start = stream->prefetched_to > read_end ? stream->prefetched_to : read_end;
+        uint64_t end = read_end + stream->window < helper_data->length ? read_end + stream->window : helper_data->length;
+        if(end > start && (end - start >= stream->window/2 || end == helper_data->length)){
+            if(stream->prefetched_to > stream->prefetched_from){
+                prefetch_filedata(helper_data->offset + stream->prefetched_from, stream->prefetched_to - stream->prefetched_from, 1, helper);
+            }
+            prefetch_filedata(helper_data->offset + start, end - start, 0, helper);
+            stream->prefetched_from = start;
+            stream->prefetched_to = end;
+        }
+    }
+    stream->next_offset = read_end;
+}
+
 int read_file(char * filename, size_t offset, size_t count, void * buf, void * helper){
+    journal_group_commit(helper);
     if(block_search(filename, helper) == -1){
         return 1;
     }
     initial_struct* helper_data = (initial_struct*) helper;
-    if( (helper_data->length - offset) < count ){          // if the count is more than bytes left to write return 2
+    append_buffer* buffer = find_append_buffer(filename,helper);
+    if(buffer != NULL){
+        helper_data->length = buffer->length; // bytes still in the tail are copied from the buffer below
+    }
+    if( offset > helper_data->length || (helper_data->length - offset) < count ){          // if the count is more than bytes left to write return 2
         return 2;
     }
-    FILE* filedata = fopen(helper_data->file_data,"rb");
-    if(filedata == NULL){
-        printf("cannot open %s", helper_data->file_data);
-        return -1;
-    } 
+
+    advise_readahead(filename,offset,count,(void*) helper_data); // prefetch the next extent while this one is verified
 
     //verify data
     int verified = -1;
@@ -719,14 +2140,19 @@ int read_file(char * filename, size_t offset, size_t count, void * buf, void * h
     }
 
     //if verified read the data
-    fseek(filedata,offset+(helper_data->offset),SEEK_SET);
-    fgets(buf,count+1,filedata);                     
-    fclose(filedata);
+    read_filedata(helper_data->offset + offset,count,buf,(void*) helper_data);
+    if(buffer != NULL && offset + count > buffer->length - buffer->tail_length){
+        uint64_t tail_start = buffer->length - buffer->tail_length;
+        uint64_t from = offset > tail_start ? offset : tail_start;
+        memcpy((char*) buf + (from - offset),buffer->tail + (from - tail_start),offset + count - from);
+    }
     return 0;
 }
 
 int write_file(char * filename, size_t offset, size_t count, void * buf, void * helper){
 
+    journal_group_commit(helper);
+    close_append_buffer(filename,helper);
     if(block_search(filename, helper) == -1){ //locate file and store information about the file in helper
         return 1;
     }
@@ -734,24 +2160,34 @@ int write_file(char * filename, size_t offset, size_t count, void * buf, void *
     if(helper_data->length < offset){
         return 2;
     }
+    //zero blocks take no physical space so a resize can succeed on a deduplicated image that cannot hold the data
+    if(helper_data->dedup != NULL && !dedup_has_room(helper_data->offset + offset,count,helper_data->offset + helper_data->length,helper)){
+        printf("too big \n");
+        return 3;
+    }
     if(count+offset > helper_data->length){
-        int x = resize_file(filename,count,(void*) helper_data);
+        int x = resize_file(filename,count+offset,(void*) helper_data);
         if(x == 2){
             printf("too big \n");
             return 3;
         } 
     }
     block_search(filename, (void*) helper_data); //after resize file information has changed block search again to store correct information
-    FILE* filedata = fopen(helper_data->file_data,"r+b");
-    fseek(filedata,helper_data->offset+offset,SEEK_SET);
-    fwrite(buf,sizeof(char),count,filedata);
+    if(write_filedata(helper_data->offset + offset,count,buf,(void*) helper_data) != 0){
+        printf("too big \n");
+        return 3;
+    }
     update_hashdata(count,helper_data->offset+offset,helper_data->height,(void*)helper_data); //update hash data before 
-    fclose(filedata);
     return 0;
 
 }
 
 ssize_t file_size(char * filename, void * helper){
+    journal_group_commit(helper);
+    append_buffer* buffer = find_append_buffer(filename,helper);
+    if(buffer != NULL){
+        return buffer->length;
+    }
     if(block_search(filename, helper) == -1){
         return -1;
     }
@@ -759,4 +2195,194 @@ ssize_t file_size(char * filename, void * helper){
     return helper_data->length;
 }
 
+/* preallocates capacity bytes for a file being appended to. The space after the file is taken in place when no other
+file starts in it, which only changes the buffer since bytes past the recorded length of the file are never read.
+Otherwise the file is moved by resize_file and its record set back to its real length. Returns 2 if there is no room */
+int reserve_append_space(append_buffer* buffer, uint64_t capacity, void* helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    directory_block* array = array_of_directory_blocks(helper);
+    uint64_t next_item = helper_data->logical_size;
+    off_t distance = -1;
+    for(size_t x = 0; x < helper_data->items_copied; x++){
+        if(strcmp(array[x].filename,buffer->filename) == 0){
+            distance = array[x].distance;
+        } else if(array[x].offset >= buffer->offset && array[x].offset < next_item){
+            next_item = array[x].offset;
+        }
+    }
+    free(array);
+    if(distance == -1){
+        return 2;
+    }
+    if(buffer->offset + capacity <= next_item && record_fits(buffer->offset + capacity,helper)){
+        buffer->capacity = capacity;
+        return 0;
+    }
+
+    //not enough room after the file, resize_file moves the recorded length behind the repacked files and zeroes the rest
+    if(record_append_length(buffer,helper) != 0){
+        return 2;
+    }
+    detach_append_buffer(buffer,helper);
+    int resized = resize_file(buffer->filename,capacity,helper);
+    buffer->next = helper_data->appends;
+    helper_data->appends = buffer;
+    if(block_search(buffer->filename,helper) == 0){
+        buffer->offset = helper_data->offset;
+        buffer->capacity = helper_data->length;
+        if(helper_data->length != buffer->length){
+            write_record_fields(helper_data->distance,buffer->offset,buffer->length,helper);
+        }
+        buffer->recorded = buffer->length;
+    }
+    return resized == 0 ? 0 : 2;
+}
+
+/* appends count bytes from buf to the end of a file. Appends are collected in a write-back buffer and written a
+whole block at a time, and space after the file is preallocated in doubling steps so most appends need no resize.
+The buffer is flushed at block boundaries, by fsync_file, close_fs and by any other operation that writes the file.
+Returns 1 if the file does not exist, 2 if there is no space and 3 if a deduplicated image does not have the free
+blocks the append could need, in which case nothing is appended */
+int append_file(char * filename, void * buf, size_t count, void * helper){
+
+    initial_struct* helper_data = (initial_struct*) helper;
+    journal_group_commit(helper);
+    append_buffer* buffer = find_append_buffer(filename,helper);
+    if(buffer == NULL){
+        if(block_search(filename,helper) == -1){
+            return 1;
+        }
+        buffer = malloc(sizeof(append_buffer));
+        strncpy(buffer->filename,filename,sizeof(buffer->filename) - 1);
+        buffer->filename[sizeof(buffer->filename) - 1] = '\0';
+        buffer->offset = helper_data->offset;
+        buffer->length = helper_data->length;
+        buffer->capacity = helper_data->length;
+        buffer->recorded = helper_data->length;
+        buffer->tail_length = 0;
+        buffer->reserved = 0;
+        buffer->next = helper_data->appends;
+        helper_data->appends = buffer;
+    }
+
+    /* on a deduplicated image every block the append touches may need a physical block, so they are checked for
+    before any byte is accepted. The block holding the end of the file counts too because every tail holds back a
+    free block, the one held for the current tail is given back first */
+    dedup_index* dedup = helper_data->dedup;
+    if(dedup != NULL){
+        if(buffer->reserved){
+            dedup->reserved_blocks--;
+            buffer->reserved = 0;
+        }
+        uint64_t end = buffer->offset + buffer->length;
+        int room = dedup_has_room(end,count,end - end % 256,helper);
+        if(!room || buffer->tail_length > 0){
+            dedup->reserved_blocks += buffer->tail_length > 0;
+            buffer->reserved = buffer->tail_length > 0;
+        }
+        if(!room){
+            return 3;
+        }
+    }
+
+    //preallocate by doubling the capacity, falling back to the exact length needed when that does not fit
+    if(buffer->length + count > buffer->capacity){
+        uint64_t needed = buffer->length + count;
+        uint64_t capacity = buffer->capacity > 256 ? buffer->capacity : 256;
+        while(capacity < needed){
+            capacity *= 2;
+        }
+        if(reserve_append_space(buffer,capacity,helper) != 0 && reserve_append_space(buffer,needed,helper) != 0){
+            return 2;
+        }
+    }
+
+    char* in = (char*) buf;
+    while(count > 0){
+        uint64_t end = buffer->offset + buffer->length;
+        if(buffer->tail_length == 0 && end % 256 == 0 && count >= 256){
+            //whole blocks skip the buffer and are hashed together
+            size_t bytes = count - count % 256;
+            if(write_filedata(end,bytes,in,helper) != 0){
+                return 3;
+            }
+            update_hashdata(bytes,end,helper_data->height,helper);
+            buffer->length += bytes;
+            in += bytes;
+            count -= bytes;
+            continue;
+        }
+        size_t room = 256 - end % 256;
+        size_t bytes = count < room ? count : room;
+        if(buffer->tail_length == 0 && dedup != NULL && !buffer->reserved){
+            dedup->reserved_blocks++; // a new tail holds back a block so it can always be written
+            buffer->reserved = 1;
+        }
+        memcpy(buffer->tail + buffer->tail_length,in,bytes);
+        buffer->tail_length += bytes;
+        buffer->length += bytes;
+        in += bytes;
+        count -= bytes;
+        if(bytes == room && flush_append_tail(buffer,helper) != 0){ // the tail reached the end of its block
+            return 3;
+        }
+    }
+    return 0;
+}
+
+/* flushes buffered appends of a file, gives up its preallocated space and makes the file durable. With the journal
+this is a single commit, which also covers every other change made so far. Without one the file's data, the hashdata
+and the directory table are forced to disk */
+int fsync_file(char * filename, void * helper){
+
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(close_append_buffer(filename,helper) != 0){
+        return 3;
+    }
+    if(block_search(filename,helper) == -1){
+        return 1;
+    }
+    if(helper_data->journal.fd != -1){
+        return journal_commit(helper) == 0 ? 0 : 3;
+    }
+    if(helper_data->filedata_pages.bitmap != NULL){
+        return journal_sync_image(helper) == 0 ? 0 : 3; // the journal was switched off after the image was mapped privately
+    }
+    if(helper_data->dedup == NULL){
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        uint64_t start = helper_data->offset / page * page;
+        msync(helper_data->filedata_map + start, helper_data->offset + helper_data->length - start, MS_SYNC);
+    } else {
+        msync(helper_data->filedata_map, helper_data->size_of_filedata, MS_SYNC); // the file's blocks can be anywhere
+        msync(helper_data->dedup->map_data, helper_data->dedup->map_size, MS_SYNC);
+    }
+    msync(helper_data->hashdata_map, helper_data->size_of_hashdata, MS_SYNC);
+    fsync(helper_data->directory_pages.fd);
+    return 0;
+}
+
+/* starts a batch of operations that are committed to the journal together. Batches nest and nothing is committed
+until the outermost batch ends */
+void begin_batch(void * helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    helper_data->journal.batch_depth++;
+}
+
+/* ends a batch. Buffered append tails are written and the lengths of files being appended to recorded so they are
+part of it, and every change made in the batch is committed with a single fdatasync. Returns 3 if the journal could
+not be synced */
+int end_batch(void * helper){
+    initial_struct* helper_data = (initial_struct*) helper;
+    if(helper_data->journal.batch_depth > 0){
+        helper_data->journal.batch_depth--;
+    }
+    if(helper_data->journal.batch_depth > 0){
+        return 0;
+    }
+    for(append_buffer* buffer = helper_data->appends; buffer != NULL; buffer = buffer->next){
+        record_append_length(buffer,helper);
+    }
+    return journal_commit(helper) == 0 ? 0 : 3;
+}
+
 #endif
\ No newline at end of file